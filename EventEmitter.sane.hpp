@@ -7,137 +7,3476 @@
 #undef __EVENTEMITTER_PROVIDER_DEFERRED
 #endif
 
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <forward_list>
-#include <map>
+#include <initializer_list>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <cstring>
+#include <cstdint>
 
 #ifndef EVENTEMITTER_DISABLE_THREADING
+#include <atomic>
 #include <condition_variable>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
+#define __EVENTEMITTER_MUTEX_DECLARE(mutex) std::mutex mutex
+#define __EVENTEMITTER_LOCK_GUARD(mutex) std::lock_guard<std::mutex> guard(mutex)
+#else
+#define __EVENTEMITTER_MUTEX_DECLARE(mutex)
+#define __EVENTEMITTER_LOCK_GUARD(mutex)
+#endif
+
+#if defined(__GNUC__)
+#define __EVENTEMITTER_GCC_WORKAROUND this->
+#else
+#define __EVENTEMITTER_GCC_WORKAROUND
+#endif
+
+#define __EVENTEMITTER_CONCAT_IMPL(x, y) x ## y
+#define __EVENTEMITTER_CONCAT(x, y) __EVENTEMITTER_CONCAT_IMPL(x, y)
+
+#if defined(EVENTEMITTER_LOCKFREE_DEFERRED) && !defined(EVENTEMITTER_DISABLE_THREADING)
+#define __EVENTEMITTER_LOCKFREE_DEFERRED
+#endif
+
+using handle_id_type = uint64_t;
+
+#ifndef EVENTEMITTER_HANDLER_INLINE_SIZE
+#define EVENTEMITTER_HANDLER_INLINE_SIZE (6 * sizeof(void*))
+#endif
+
+// define EVENTEMITTER_STATS to record emit counts, latencies and deferred
+// queue depth, see statsX(); compiled out otherwise
+#ifdef EVENTEMITTER_STATS
+#include <atomic>
+#include <chrono>
+#endif
+// C++20 coroutines: the nextX() and streamX() awaitables
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <memory>
+#include <optional>
+#define __EVENTEMITTER_COROUTINES
+#endif
+#endif
+// counter shards per emitter, a power of two
+#ifndef EVENTEMITTER_STATS_SHARDS
+#define EVENTEMITTER_STATS_SHARDS 8
+#endif
+
+// stateless allocator template for handler arrays, oversized handlers and
+// deferred event buffers
+#ifndef EVENTEMITTER_ALLOCATOR
+#define EVENTEMITTER_ALLOCATOR std::allocator
+#endif
+
+// workers of the shared pool running async handlers, 0 for one per core
+#ifndef EVENTEMITTER_THREAD_POOL_SIZE
+#define EVENTEMITTER_THREAD_POOL_SIZE 0
+#endif
+// tasks the shared pool queues before posting runs them on the caller
+#ifndef EVENTEMITTER_THREAD_POOL_CAPACITY
+#define EVENTEMITTER_THREAD_POOL_CAPACITY 65536
+#endif
+// pin each worker of the shared pool to one core (Linux only)
+#ifndef EVENTEMITTER_THREAD_POOL_PIN
+#define EVENTEMITTER_THREAD_POOL_PIN 0
+#endif
+// fewest handlers parallelTrigger hands to one thread, below twice this
+// many handlers it runs them inline
+#ifndef EVENTEMITTER_PARALLEL_GRAIN
+#define EVENTEMITTER_PARALLEL_GRAIN 16
+#endif
+// shards of the name table of a dispatcher over a threaded emitter, a
+// power of two
+#ifndef EVENTEMITTER_DISPATCHER_SHARDS
+#define EVENTEMITTER_DISPATCHER_SHARDS 16
+#endif
+
+#ifndef __EVENTEMITTER_NONMACRO_DEFS
+#define __EVENTEMITTER_NONMACRO_DEFS
+namespace EE {
+	// what a handler for an argument of type T receives: references pass
+	// through, values are fanned out to every handler as the same const object
+	template<typename T> using HandlerArg = std::conditional_t<std::is_reference<T>::value, T, const T&>;
+
+	template<typename T> using Allocator = EVENTEMITTER_ALLOCATOR<T>;
+	template<typename T> using Vector = std::vector<T, Allocator<T>>;
+
+	template<typename T, typename... Args> T* allocateObject(Args&&... args) {
+		Allocator<T> allocator;
+		T* p = std::allocator_traits<Allocator<T>>::allocate(allocator, 1);
+		try {
+			new(p) T(std::forward<Args>(args)...);
+		}
+		catch(...) {
+			std::allocator_traits<Allocator<T>>::deallocate(allocator, p, 1);
+			throw;
+		}
+		return p;
+	}
+	template<typename T> void freeObject(T* p) {
+		Allocator<T> allocator;
+		p->~T();
+		std::allocator_traits<Allocator<T>>::deallocate(allocator, p, 1);
+	}
+
+	template<typename F, typename Tuple, size_t... I>
+	inline void applyTuple(F&& f, Tuple& args, std::index_sequence<I...>) {
+		f(std::get<I>(args)...);
+	}
+	template<typename F, typename Tuple>
+	inline void applyTuple(F&& f, Tuple& args) {
+		applyTuple(std::forward<F>(f), args, std::make_index_sequence<std::tuple_size<Tuple>::value>());
+	}
+
+	template<typename Signature, size_t Size = EVENTEMITTER_HANDLER_INLINE_SIZE> class InplaceFunction;
+
+	// std::function replacement that keeps callables of up to Size bytes in
+	// place, only larger ones (or ones with throwing moves) go to the heap.
+	// Arguments are passed as HandlerArg, so value arguments are never copied
+	// on the way to the callable. Move-only callables are accepted, copying an
+	// InplaceFunction holding one throws std::bad_function_call.
+	template<typename R, typename... Args, size_t Size>
+	class InplaceFunction<R(Args...), Size> {
+		template<typename F> static void copyConstruct(void* dst, const F& f, std::true_type) {
+			new(dst) F(f);
+		}
+		template<typename F> static void copyConstruct(void*, const F&, std::false_type) {
+			throw std::bad_function_call();
+		}
+		template<typename F> static F* clone(const F& f, std::true_type) {
+			return allocateObject<F>(f);
+		}
+		template<typename F> static F* clone(const F&, std::false_type) {
+			throw std::bad_function_call();
+		}
+		struct Ops {
+			R (*invoke)(void*, HandlerArg<Args>...);
+			void (*copy)(void*, const void*);
+			// move-constructs into the first argument and destroys the second
+			void (*move)(void*, void*);
+			void (*destroy)(void*);
+		};
+		template<typename F> struct InlineOps {
+			static R invoke(void* p, HandlerArg<Args>... args) {
+				return (*static_cast<F*>(p))(std::forward<HandlerArg<Args>>(args)...);
+			}
+			static void copy(void* dst, const void* src) {
+				copyConstruct(dst, *static_cast<const F*>(src), std::is_copy_constructible<F>());
+			}
+			static void move(void* dst, void* src) {
+				new(dst) F(std::move(*static_cast<F*>(src)));
+				static_cast<F*>(src)->~F();
+			}
+			static void destroy(void* p) {
+				static_cast<F*>(p)->~F();
+			}
+			static const Ops* get() {
+				static const Ops ops = { &invoke, &copy, &move, &destroy };
+				return &ops;
+			}
+		};
+		template<typename F> struct HeapOps {
+			static F* target(const void* p) {
+				return *static_cast<F* const*>(p);
+			}
+			static R invoke(void* p, HandlerArg<Args>... args) {
+				return (*target(p))(std::forward<HandlerArg<Args>>(args)...);
+			}
+			static void copy(void* dst, const void* src) {
+				new(dst) F*(clone(*target(src), std::is_copy_constructible<F>()));
+			}
+			static void move(void* dst, void* src) {
+				new(dst) F*(target(src));
+			}
+			static void destroy(void* p) {
+				freeObject(target(p));
+			}
+			static const Ops* get() {
+				static const Ops ops = { &invoke, &copy, &move, &destroy };
+				return &ops;
+			}
+		};
+		template<typename F> using FitsInline = std::integral_constant<bool,
+			sizeof(F) <= Size && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<F>::value>;
+
+		alignas(std::max_align_t) unsigned char storage[Size];
+		const Ops* ops = nullptr;
+
+		template<typename F> void assign(F&& f, std::true_type) {
+			new(storage) std::decay_t<F>(std::forward<F>(f));
+			ops = InlineOps<std::decay_t<F>>::get();
+		}
+		template<typename F> void assign(F&& f, std::false_type) {
+			new(storage) std::decay_t<F>*(allocateObject<std::decay_t<F>>(std::forward<F>(f)));
+			ops = HeapOps<std::decay_t<F>>::get();
+		}
+		void reset() {
+			if(ops) {
+				ops->destroy(storage);
+				ops = nullptr;
+			}
+		}
+	public:
+		InplaceFunction() noexcept {}
+		InplaceFunction(std::nullptr_t) noexcept {}
+		template<typename F,
+			typename = std::enable_if_t<!std::is_same<std::decay_t<F>, InplaceFunction>::value>,
+			typename = decltype(std::declval<std::decay_t<F>&>()(std::declval<HandlerArg<Args>>()...))>
+		InplaceFunction(F&& f) {
+			assign(std::forward<F>(f), FitsInline<std::decay_t<F>>());
+		}
+		InplaceFunction(const InplaceFunction& other) : ops(other.ops) {
+			if(ops) {
+				ops->copy(storage, other.storage);
+			}
+		}
+		InplaceFunction(InplaceFunction&& other) noexcept : ops(other.ops) {
+			if(ops) {
+				ops->move(storage, other.storage);
+				other.ops = nullptr;
+			}
+		}
+		~InplaceFunction() {
+			reset();
+		}
+		InplaceFunction& operator=(const InplaceFunction& other) {
+			if(this != &other) {
+				InplaceFunction copy(other);
+				*this = std::move(copy);
+			}
+			return *this;
+		}
+		InplaceFunction& operator=(InplaceFunction&& other) noexcept {
+			if(this != &other) {
+				reset();
+				if(other.ops) {
+					other.ops->move(storage, other.storage);
+					ops = other.ops;
+					other.ops = nullptr;
+				}
+			}
+			return *this;
+		}
+		InplaceFunction& operator=(std::nullptr_t) noexcept {
+			reset();
+			return *this;
+		}
+		explicit operator bool() const noexcept {
+			return ops != nullptr;
+		}
+		R operator()(HandlerArg<Args>... args) const {
+			if(!ops) {
+				throw std::bad_function_call();
+			}
+			return ops->invoke(const_cast<unsigned char*>(storage), std::forward<HandlerArg<Args>>(args)...);
+		}
+	};
+
+	// circular buffer growing by doubling, elements are constructed in place
+	template<typename T>
+	class Ring {
+		T* items = nullptr;
+		size_t mask = 0;
+		size_t head = 0;
+		size_t count = 0;
+
+		T* slot(size_t i) const {
+			return items + ((head + i) & mask);
+		}
+		void grow(size_t capacity) {
+			Allocator<T> allocator;
+			T* moved = std::allocator_traits<Allocator<T>>::allocate(allocator, capacity);
+			for(size_t i = 0;i < count;++i) {
+				new(moved + i) T(std::move(*slot(i)));
+				slot(i)->~T();
+			}
+			if(items) {
+				std::allocator_traits<Allocator<T>>::deallocate(allocator, items, mask + 1);
+			}
+			items = moved;
+			mask = capacity - 1;
+			head = 0;
+		}
+	public:
+		Ring() {}
+		Ring(const Ring&) = delete;
+		~Ring() {
+			clear();
+			if(items) {
+				Allocator<T> allocator;
+				std::allocator_traits<Allocator<T>>::deallocate(allocator, items, mask + 1);
+			}
+		}
+		size_t size() const {
+			return count;
+		}
+		bool empty() const {
+			return count == 0;
+		}
+		void reserve(size_t capacity) {
+			size_t rounded = 8;
+			while(rounded < capacity) {
+				rounded <<= 1;
+			}
+			if(!items || rounded > mask + 1) {
+				grow(rounded);
+			}
+		}
+		template<typename... Args> T& emplace_back(Args&&... args) {
+			if(!items || count == mask + 1) {
+				reserve(count + 1);
+			}
+			T* item = new(slot(count)) T(std::forward<Args>(args)...);
+			++count;
+			return *item;
+		}
+		T& front() {
+			return *slot(0);
+		}
+		T& operator[](size_t i) {
+			return *slot(i);
+		}
+		void pop_front() {
+			slot(0)->~T();
+			head = (head + 1) & mask;
+			--count;
+		}
+		void pop_back() {
+			slot(count - 1)->~T();
+			--count;
+		}
+		void clear() {
+			while(count) {
+				pop_front();
+			}
+			head = 0;
+		}
+		void swap(Ring& other) {
+			std::swap(items, other.items);
+			std::swap(mask, other.mask);
+			std::swap(head, other.head);
+			std::swap(count, other.count);
+		}
+	};
+
+	// samples bucketed by powers of two of nanoseconds, counts[i] holds
+	// samples of at least 2^(i-1) and below 2^i ns
+	struct LatencyHistogram {
+		static const size_t buckets = 32;
+		uint64_t counts[buckets] = {};
+
+		uint64_t total() const {
+			uint64_t sum = 0;
+			for(uint64_t count : counts) {
+				sum += count;
+			}
+			return sum;
+		}
+		// upper bound in ns of the bucket holding the q quantile, 0 if empty
+		uint64_t quantile(double q) const {
+			uint64_t rank = uint64_t(q * total());
+			uint64_t seen = 0;
+			for(size_t i = 0;i < buckets;++i) {
+				seen += counts[i];
+				if(counts[i] && seen > rank) {
+					return uint64_t(1) << i;
+				}
+			}
+			return 0;
+		}
+	};
+
+	// what statsX returns, all zero unless EVENTEMITTER_STATS is defined
+	// (handlers is always filled in)
+	struct StatsSnapshot {
+		uint64_t emits = 0;
+		uint64_t handlerCalls = 0;
+		size_t handlers = 0;
+		LatencyHistogram emitLatency;
+		LatencyHistogram handlerLatency;
+		// deferred emitters: time from trigger to run, and the most events
+		// the queue has held
+		LatencyHistogram residence;
+		size_t queueHighWater = 0;
+	};
+
+#ifdef EVENTEMITTER_STATS
+	inline int64_t statsClock() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	struct AtomicHistogram {
+		std::atomic<uint64_t> counts[LatencyHistogram::buckets];
+
+		AtomicHistogram() {
+			for(auto& count : counts) {
+				count.store(0, std::memory_order_relaxed);
+			}
+		}
+		void record(int64_t nanoseconds) {
+			size_t i = 0;
+			while(i + 1 < LatencyHistogram::buckets && nanoseconds >= (int64_t(1) << i)) {
+				++i;
+			}
+			counts[i].fetch_add(1, std::memory_order_relaxed);
+		}
+		void addTo(LatencyHistogram& histogram) const {
+			for(size_t i = 0;i < LatencyHistogram::buckets;++i) {
+				histogram.counts[i] += counts[i].load(std::memory_order_relaxed);
+			}
+		}
+	};
+
+	// Emit counters of one handler store, sharded by thread so emits from
+	// several threads do not share cache lines. The shards are allocated by
+	// the first emit, through EVENTEMITTER_ALLOCATOR, stores that never emit
+	// cost one pointer.
+	class EmitStats {
+		// padded rather than aligned, C++14 new ignores extended alignment
+		struct Shard {
+			std::atomic<uint64_t> emits{0};
+			std::atomic<uint64_t> handlerCalls{0};
+			AtomicHistogram emitLatency;
+			AtomicHistogram handlerLatency;
+			char pad[64];
+		};
+		std::atomic<Shard*> shards{nullptr};
+
+		static Shard* allocateShards() {
+			Allocator<Shard> allocator;
+			Shard* all = std::allocator_traits<Allocator<Shard>>::allocate(allocator, EVENTEMITTER_STATS_SHARDS);
+			for(size_t i = 0;i < EVENTEMITTER_STATS_SHARDS;++i) {
+				new(all + i) Shard();
+			}
+			return all;
+		}
+		static void freeShards(Shard* all) {
+			if(!all) {
+				return;
+			}
+			Allocator<Shard> allocator;
+			for(size_t i = 0;i < EVENTEMITTER_STATS_SHARDS;++i) {
+				all[i].~Shard();
+			}
+			std::allocator_traits<Allocator<Shard>>::deallocate(allocator, all, EVENTEMITTER_STATS_SHARDS);
+		}
+		static size_t threadIndex() {
+			static std::atomic<size_t> next{0};
+			static thread_local size_t index = next++;
+			return index;
+		}
+		template<typename F> static void timeHandler(Shard& shard, F&& f) {
+			int64_t from = statsClock();
+			f();
+			shard.handlerLatency.record(statsClock() - from);
+			shard.handlerCalls.fetch_add(1, std::memory_order_relaxed);
+		}
+		Shard& shard() {
+			Shard* all = shards.load(std::memory_order_acquire);
+			if(!all) {
+				Shard* fresh = allocateShards();
+				if(shards.compare_exchange_strong(all, fresh, std::memory_order_acq_rel)) {
+					all = fresh;
+				}
+				else {
+					freeShards(fresh);
+				}
+			}
+			return all[threadIndex() & (EVENTEMITTER_STATS_SHARDS - 1)];
+		}
+	public:
+		// times one emit of count events and the handler calls in it
+		class Emit {
+			Shard& shard;
+			uint64_t count;
+			int64_t start;
+		public:
+			Emit(EmitStats& stats, uint64_t _count = 1) : shard(stats.shard()), count(_count), start(statsClock()) {}
+			~Emit() {
+				shard.emits.fetch_add(count, std::memory_order_relaxed);
+				shard.emitLatency.record(statsClock() - start);
+			}
+			template<typename F> void handler(F&& f) {
+				timeHandler(shard, std::forward<F>(f));
+			}
+		};
+		// times one handler call outside of an Emit
+		template<typename F> void handler(F&& f) {
+			timeHandler(shard(), std::forward<F>(f));
+		}
+		EmitStats() {}
+		// counters are not copied
+		EmitStats(const EmitStats&) {}
+		EmitStats& operator=(const EmitStats&) {
+			return *this;
+		}
+		~EmitStats() {
+			freeShards(shards.load());
+		}
+		void addTo(StatsSnapshot& snapshot) const {
+			const Shard* all = shards.load(std::memory_order_acquire);
+			for(size_t i = 0;all && i < EVENTEMITTER_STATS_SHARDS;++i) {
+				snapshot.emits += all[i].emits.load(std::memory_order_relaxed);
+				snapshot.handlerCalls += all[i].handlerCalls.load(std::memory_order_relaxed);
+				all[i].emitLatency.addTo(snapshot.emitLatency);
+				all[i].handlerLatency.addTo(snapshot.handlerLatency);
+			}
+		}
+	};
+#endif
+
+#ifndef EVENTEMITTER_DISABLE_THREADING
+	typedef std::mutex DeferredMutex;
+#else
+	struct DeferredMutex {
+		void lock() {}
+		void unlock() {}
+	};
+#endif
+
+	class DeferredLock {
+		DeferredMutex& mutex;
+		bool owns;
+	public:
+		explicit DeferredLock(DeferredMutex& _mutex) : mutex(_mutex), owns(true) {
+			mutex.lock();
+		}
+		DeferredLock(const DeferredLock&) = delete;
+		~DeferredLock() {
+			if(owns) {
+				mutex.unlock();
+			}
+		}
+		void lock() {
+			mutex.lock();
+			owns = true;
+		}
+		void unlock() {
+			owns = false;
+			mutex.unlock();
+		}
+		bool owns_lock() const {
+			return owns;
+		}
+	};
+
+	// Compact id of an event name interned by a dispatcher.
+	typedef uint32_t EventId;
+	static const EventId noEventId = EventId(-1);
+
+	// First argument of the events a dispatcher emits, deferred queues
+	// recognise it to keep events of one key in order while other keys run
+	// in parallel.
+	struct EventKey {
+		EventId id;
+	};
+
+	template<typename Tuple> struct DeferredKey {
+		static const bool keyed = false;
+		static size_t of(const Tuple&) {
+			return 0;
+		}
+		template<typename... Args> static size_t ofArgs(const Args&...) {
+			return 0;
+		}
+	};
+	template<typename... Rest> struct DeferredKey<std::tuple<EventKey, Rest...>> {
+		static const bool keyed = true;
+		static size_t of(const std::tuple<EventKey, Rest...>& args) {
+			return std::get<0>(args).id;
+		}
+		template<typename... Args> static size_t ofArgs(EventKey key, const Args&...) {
+			return key.id;
+		}
+	};
+
+	// A closure queued by an emitter (triggerXBatch, triggerXByRef and the
+	// like) with the emitter, so runDeferredParallel can keep it in order
+	// with the emitter's other events.
+	typedef std::tuple<InplaceFunction<void ()>, const void*> DeferredClosure;
+
+	template<typename Tuple> struct DeferredOwner {
+		static const bool closure = false;
+		static const void* of(const void* owner, const Tuple&) {
+			return owner;
+		}
+		template<typename... Args> static const void* ofArgs(const void* owner, const Args&...) {
+			return owner;
+		}
+	};
+	template<> struct DeferredOwner<DeferredClosure> {
+		static const bool closure = true;
+		static const void* of(const void*, const DeferredClosure& closure) {
+			return std::get<1>(closure);
+		}
+		template<typename F> static const void* ofArgs(const void*, const F&, const void* owner) {
+			return owner;
+		}
+	};
+
+	// true for emitters whose trigger queues the event instead of running it
+	template<typename T, typename = void> struct TriggerIsDeferred : std::false_type {};
+	template<typename T> struct TriggerIsDeferred<T, typename std::conditional<true, void, typename T::DeferredTrigger>::type> : std::true_type {};
+
+	// what a trigger into a full bounded deferred queue does
+	enum class DeferredOverflow {
+		block,      // waits for room, tryTrigger rejects the event
+		dropNewest, // rejects the event
+		dropOldest, // drops the oldest pending event to make room
+		coalesce    // replaces the newest pending event of the same emitter
+		            // (or dispatcher key), rejects the event if there is none
+	};
+
+	// which events runDeferredParallel keeps in trigger order
+	enum class DeferredOrder {
+		none,       // any event of a threaded emitter may run next to any
+		            // other, other emitters keep perKey order
+		perEmitter, // events of one emitter run in order
+		perKey      // like perEmitter, events of a dispatcher in order per key
+	};
+
+#ifndef EVENTEMITTER_DISABLE_THREADING
+	// Fixed set of workers, each with its own task queue. Posting from
+	// outside spreads tasks round robin, a worker posts to its own queue,
+	// and idle workers steal from the others. At most capacity tasks wait;
+	// past that post runs the task on the caller, which also keeps a worker
+	// posting into a full pool from deadlocking. Tasks that throw are
+	// dropped like an exception in a discarded std::async future.
+	class ThreadPool {
+	public:
+		typedef InplaceFunction<void()> Task;
+	private:
+		struct Worker {
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::vector<std::thread> threads;
+		std::mutex sleepMutex;
+		std::condition_variable wakeup;
+		std::atomic<size_t> queued;
+		std::atomic<size_t> next;
+		size_t capacity;
+		bool stopping = false;
+
+		static ThreadPool*& currentPool() {
+			static thread_local ThreadPool* pool = nullptr;
+			return pool;
+		}
+		static size_t& currentWorker() {
+			static thread_local size_t worker = 0;
+			return worker;
+		}
+		bool take(size_t self, Task& task) {
+			{
+				Worker& own = *workers[self];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if(!own.tasks.empty()) {
+					task = std::move(own.tasks.front());
+					own.tasks.pop_front();
+					return true;
+				}
+			}
+			for(size_t i = 1;i < workers.size();++i) {
+				Worker& victim = *workers[(self + i) % workers.size()];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if(!victim.tasks.empty()) {
+					task = std::move(victim.tasks.back());
+					victim.tasks.pop_back();
+					return true;
+				}
+			}
+			return false;
+		}
+		void work(size_t self) {
+			currentPool() = this;
+			currentWorker() = self;
+			for(;;) {
+				Task task;
+				if(take(self, task)) {
+					--queued;
+					try {
+						task();
+					}
+					catch(...) {
+					}
+					continue;
+				}
+				std::unique_lock<std::mutex> lock(sleepMutex);
+				if(stopping && queued == 0) {
+					return;
+				}
+				wakeup.wait(lock, [this] {
+					return queued != 0 || stopping;
+				});
+			}
+		}
+	public:
+		explicit ThreadPool(size_t size = 0, size_t _capacity = EVENTEMITTER_THREAD_POOL_CAPACITY, bool pin = false)
+			: queued(0), next(0), capacity(_capacity) {
+			size_t cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			if(size == 0) {
+				size = cores;
+			}
+			for(size_t i = 0;i < size;++i) {
+				workers.emplace_back(new Worker());
+			}
+			for(size_t i = 0;i < size;++i) {
+				threads.emplace_back([this, i] {
+					work(i);
+				});
+#if defined(__linux__)
+				if(pin) {
+					cpu_set_t set;
+					CPU_ZERO(&set);
+					CPU_SET(i % cores, &set);
+					pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+				}
+#endif
+			}
+		}
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		// runs what is still queued, then joins the workers
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+				stopping = true;
+			}
+			wakeup.notify_all();
+			for(auto& thread : threads) {
+				thread.join();
+			}
+		}
+		template<typename F> void post(F&& f) {
+			if(queued.load(std::memory_order_relaxed) >= capacity) {
+				f();
+				return;
+			}
+			size_t target = currentPool() == this ? currentWorker() : next++ % workers.size();
+			{
+				Worker& worker = *workers[target];
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				worker.tasks.emplace_back(std::forward<F>(f));
+			}
+			++queued;
+			// the sleeping worker checks queued under sleepMutex
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+			}
+			wakeup.notify_one();
+		}
+		size_t size() const {
+			return threads.size();
+		}
+	};
+
+	// the pool async handlers and asyncWait run on
+	inline ThreadPool& defaultThreadPool() {
+		static ThreadPool pool(EVENTEMITTER_THREAD_POOL_SIZE, EVENTEMITTER_THREAD_POOL_CAPACITY, EVENTEMITTER_THREAD_POOL_PIN);
+		return pool;
+	}
+
+	// One thread running tasks at their deadlines, kept in a heap. Tasks
+	// should be short, like posting to a pool. cancel returns once the task
+	// can no longer run, waiting for it if it is running, so what the task
+	// uses may be freed after; a task must not cancel itself.
+	class TimerQueue {
+		typedef InplaceFunction<void()> Task;
+		struct Timer {
+			std::chrono::steady_clock::time_point at;
+			uint64_t id;
+			Task task;
+		};
+		std::mutex mutex;
+		std::condition_variable changed;
+		Vector<Timer> timers;
+		uint64_t lastId = 0;
+		uint64_t running = 0;
+		bool stopping = false;
+		std::thread thread;
+
+		static bool later(const Timer& a, const Timer& b) {
+			return a.at > b.at;
+		}
+		void work() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while(!stopping) {
+				if(timers.empty()) {
+					changed.wait(lock);
+					continue;
+				}
+				std::chrono::steady_clock::time_point at = timers.front().at;
+				if(std::chrono::steady_clock::now() < at) {
+					changed.wait_until(lock, at);
+					continue;
+				}
+				std::pop_heap(timers.begin(), timers.end(), &later);
+				Task task = std::move(timers.back().task);
+				running = timers.back().id;
+				timers.pop_back();
+				lock.unlock();
+				try {
+					task();
+				}
+				catch(...) {
+				}
+				task = nullptr;
+				lock.lock();
+				running = 0;
+				changed.notify_all();
+			}
+		}
+	public:
+		TimerQueue() : thread([this] {
+			work();
+		}) {}
+		TimerQueue(const TimerQueue&) = delete;
+		TimerQueue& operator=(const TimerQueue&) = delete;
+		// drops the tasks that have not run yet
+		~TimerQueue() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			changed.notify_all();
+			thread.join();
+		}
+		// the id is never zero
+		template<typename F> uint64_t schedule(std::chrono::milliseconds delay, F&& f) {
+			std::lock_guard<std::mutex> lock(mutex);
+			uint64_t id = ++lastId;
+			timers.push_back(Timer{std::chrono::steady_clock::now() + delay, id, Task(std::forward<F>(f))});
+			std::push_heap(timers.begin(), timers.end(), &later);
+			changed.notify_all();
+			return id;
+		}
+		void cancel(uint64_t id) {
+			std::unique_lock<std::mutex> lock(mutex);
+			auto it = std::find_if(timers.begin(), timers.end(), [id](const Timer& timer) {
+				return timer.id == id;
+			});
+			if(it != timers.end()) {
+				timers.erase(it);
+				std::make_heap(timers.begin(), timers.end(), &later);
+				return;
+			}
+			changed.wait(lock, [this, id] {
+				return running != id;
+			});
+		}
+	};
+
+	// the timer asyncWait times out on, its thread starts on first use.
+	// Its tasks post to the shared pool, which is constructed first so it
+	// is destroyed after the timer thread has stopped.
+	inline TimerQueue& defaultTimerQueue() {
+		defaultThreadPool();
+		static TimerQueue timers;
+		return timers;
+	}
+
+	struct ParallelForState {
+		std::atomic<size_t> next;
+		std::atomic<size_t> done;
+		size_t chunks;
+		InplaceFunction<void(size_t)> run;
+		std::mutex mutex;
+		std::condition_variable finished;
+		std::exception_ptr error;
+
+		ParallelForState(size_t _chunks) : next(0), done(0), chunks(_chunks) {}
+		void work() {
+			for(size_t chunk;(chunk = next++) < chunks;) {
+				try {
+					run(chunk);
+				}
+				catch(...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if(!error) {
+						error = std::current_exception();
+					}
+				}
+				if(++done == chunks) {
+					std::lock_guard<std::mutex> lock(mutex);
+					finished.notify_all();
+				}
+			}
+		}
+	};
+
+	// Runs f(0) to f(chunks - 1) on the caller and on pool workers and
+	// returns when all have finished, rethrowing the first exception.
+	// Chunks are claimed from a shared counter and the caller claims too,
+	// so it only ever waits for chunks that are already running and may
+	// itself be a pool worker.
+	// Uses at most threads threads when given.
+	template<typename F> void parallelFor(ThreadPool& pool, size_t chunks, F&& f, size_t threads = 0) {
+		if(chunks == 0) {
+			return;
+		}
+		auto state = std::make_shared<ParallelForState>(chunks);
+		state->run = [&f](size_t chunk) {
+			f(chunk);
+		};
+		size_t helpers = std::min(chunks - 1, pool.size());
+		if(threads) {
+			helpers = std::min(helpers, threads - 1);
+		}
+		for(size_t i = 1;i <= helpers;++i) {
+			pool.post([state] {
+				state->work();
+			});
+		}
+		state->work();
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->finished.wait(lock, [&state] {
+			return state->done == state->chunks;
+		});
+		if(state->error) {
+			std::rethrow_exception(state->error);
+		}
+	}
+
+	// first exception thrown by the handlers of a parallel run
+	struct FirstError {
+		std::mutex mutex;
+		std::exception_ptr error;
+		void capture() {
+			std::lock_guard<std::mutex> lock(mutex);
+			if(!error) {
+				error = std::current_exception();
+			}
+		}
+	};
+#endif
+
+	class DeferredBase;
+
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+	// anything holding typed events queued in a DeferredBase, the base only
+	// keeps one pointer per event to preserve the order across emitters
+	class DeferredSink {
+		friend class DeferredBase;
+		bool listed = false;
+	protected:
+		~DeferredSink() {}
+		// moves the pending events to the draining buffer, queue mutex held
+		virtual void detach() = 0;
+		// runs and removes the oldest draining event, consumer only
+		virtual void runDrained() = 0;
+		// removes the oldest pending event, releases the queue lock and runs it
+		virtual void runPending(DeferredLock& lock) = 0;
+		// drops all pending events, queue mutex held
+		virtual void clearPending() = 0;
+		// drops the oldest pending event, queue mutex held
+		virtual void dropPending() = 0;
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		// runs one of parts contiguous slices of the draining events in
+		// order, keeping them in the buffer
+		virtual void runDrainedPart(size_t part, size_t parts, FirstError& error) = 0;
+		// appends the index of each draining event to buckets[key % parts]
+		virtual void bucketDrained(std::vector<size_t>* buckets, size_t parts) = 0;
+		// runs the draining events at indices in order, keeping them in the
+		// buffer
+		virtual void runDrainedList(const std::vector<size_t>& indices, FirstError& error) = 0;
+		virtual bool keyed() const = 0;
+		// whether events of the sink may run on several threads at once
+		virtual bool concurrent() const = 0;
+		// whether the events belong to different emitters
+		virtual bool closures() const = 0;
+		virtual size_t drainedSize() const = 0;
+		// the emitter of the i-th draining event
+		virtual const void* drainedOwner(size_t i) = 0;
+		// runs the i-th draining event, keeping it in the buffer
+		virtual void runDrainedAt(size_t i, FirstError& error) = 0;
+#endif
+		// drops the draining events, consumer only
+		virtual void clearDrained() = 0;
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		// runDeferredParallel's bookkeeping, consumer only
+		bool ordered = false;
+		size_t cursor = 0;
+#endif
+	};
+
+	// when each event of a channel was queued, kept alongside its buffers to
+	// record how long events wait; empty without EVENTEMITTER_STATS
+	class DeferredTimes {
+#ifdef EVENTEMITTER_STATS
+		Ring<int64_t> pending;
+		Ring<int64_t> draining;
+		AtomicHistogram residence;
+
+		void record(int64_t queued) {
+			residence.record(statsClock() - queued);
+		}
+	protected:
+		void queued() {
+			pending.emplace_back(statsClock());
+		}
+		void unqueued() {
+			pending.pop_back();
+		}
+		void detached() {
+			pending.swap(draining);
+		}
+		void ranPending() {
+			record(pending.front());
+			pending.pop_front();
+		}
+		void droppedPending() {
+			pending.pop_front();
+		}
+		void clearedPending() {
+			pending.clear();
+		}
+		void ranDrained() {
+			record(draining.front());
+			draining.pop_front();
+		}
+		void ranDrained(size_t i) {
+			record(draining[i]);
+		}
+		void clearedDrained() {
+			draining.clear();
+		}
+	public:
+		void addTo(StatsSnapshot& snapshot) const {
+			residence.addTo(snapshot.residence);
+		}
+#else
+	protected:
+		void queued() {}
+		void unqueued() {}
+		void detached() {}
+		void ranPending() {}
+		void droppedPending() {}
+		void clearedPending() {}
+		void ranDrained() {}
+		void ranDrained(size_t) {}
+		void clearedDrained() {}
+	public:
+		void addTo(StatsSnapshot&) const {}
+#endif
+	};
+
+	// per-emitter queue of argument tuples, the tuples are constructed in place
+	// and moved out of the buffer once to run
+	template<typename Tuple>
+	class DeferredChannel : public DeferredSink, public DeferredTimes {
+		friend class DeferredBase;
+	public:
+		typedef void (*Invoke)(void* owner, Tuple& args);
+		// concurrent when the owner's handlers are safe to run on several
+		// threads at once, DeferredOrder::none only splits such channels
+		DeferredChannel(void* _owner, Invoke _invoke, bool _concurrent = false) : owner(_owner), invoke(_invoke), isConcurrent(_concurrent) {}
+		DeferredChannel(const DeferredChannel&) = delete;
+	private:
+		void* owner;
+		Invoke invoke;
+		bool isConcurrent;
+		Ring<Tuple> pending;
+		Ring<Tuple> draining;
+		// sequence number of the oldest pending event
+		size_t popped = 0;
+		// keyed channels: sequence number + 1 of the newest pending event per key
+		Vector<size_t> newest;
+		// a trigger overwrites the newest pending event of its key
+		bool coalescing = false;
+
+		void detach() override {
+			popped += pending.size();
+			pending.swap(draining);
+			detached();
+		}
+		void runDrained() override {
+			// popped first, a handler's nested runDeferred runs the next one
+			Tuple args(std::move(draining.front()));
+			draining.pop_front();
+			ranDrained();
+			invoke(owner, args);
+		}
+		void runPending(DeferredLock& lock) override {
+			Tuple args(std::move(pending.front()));
+			pending.pop_front();
+			++popped;
+			ranPending();
+			lock.unlock();
+			invoke(owner, args);
+		}
+		void clearPending() override {
+			popped += pending.size();
+			pending.clear();
+			clearedPending();
+		}
+		void dropPending() override {
+			pending.pop_front();
+			++popped;
+			droppedPending();
+		}
+		// the rest is called with the queue mutex held
+		// makes room to record an event of key, before anything is queued
+		void track(size_t key) {
+			if(DeferredKey<Tuple>::keyed && key >= newest.size()) {
+				newest.resize(key + 1);
+			}
+		}
+		// records the event just queued with key
+		void appended(size_t key) {
+			if(DeferredKey<Tuple>::keyed) {
+				newest[key] = popped + pending.size();
+			}
+		}
+		// replaces the newest pending event with the same key in place,
+		// false when there is none
+		template<typename... Args> bool coalesce(size_t key, Args&&... fargs) {
+			size_t i = pending.size();
+			if(DeferredKey<Tuple>::keyed) {
+				i = key < newest.size() && newest[key] > popped ? newest[key] - popped : 0;
+			}
+			else if(DeferredOwner<Tuple>::closure) {
+				// closures of every emitter share the channel, only one of the
+				// same emitter is replaced
+				const void* from = DeferredOwner<Tuple>::ofArgs(owner, fargs...);
+				while(i && DeferredOwner<Tuple>::of(owner, pending[i - 1]) != from) {
+					--i;
+				}
+			}
+			if(i == 0 || i > pending.size()) {
+				return false;
+			}
+			pending[i - 1] = Tuple(std::forward<Args>(fargs)...);
+			return true;
+		}
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		void runDrainedPart(size_t part, size_t parts, FirstError& error) override {
+			size_t n = draining.size();
+			for(size_t i = part * n / parts, to = (part + 1) * n / parts;i < to;++i) {
+				DeferredChannel::runDrainedAt(i, error);
+			}
+		}
+		void bucketDrained(std::vector<size_t>* buckets, size_t parts) override {
+			for(size_t i = 0;i < draining.size();++i) {
+				buckets[DeferredKey<Tuple>::of(draining[i]) % parts].push_back(i);
+			}
+		}
+		void runDrainedList(const std::vector<size_t>& indices, FirstError& error) override {
+			for(size_t i : indices) {
+				DeferredChannel::runDrainedAt(i, error);
+			}
+		}
+		bool keyed() const override {
+			return DeferredKey<Tuple>::keyed;
+		}
+		bool concurrent() const override {
+			return isConcurrent;
+		}
+		bool closures() const override {
+			return DeferredOwner<Tuple>::closure;
+		}
+		size_t drainedSize() const override {
+			return draining.size();
+		}
+		const void* drainedOwner(size_t i) override {
+			return DeferredOwner<Tuple>::of(owner, draining[i]);
+		}
+		void runDrainedAt(size_t i, FirstError& error) override {
+			ranDrained(i);
+			try {
+				invoke(owner, draining[i]);
+			}
+			catch(...) {
+				error.capture();
+			}
+		}
+#endif
+		void clearDrained() override {
+			draining.clear();
+			clearedDrained();
+		}
+	};
+#else
+	// Per-thread cache of deferred records. A block goes back to the arena of
+	// the thread that allocated it, whichever thread frees it, so a producer
+	// reuses the records its consumer ran and steady-state triggers neither
+	// call malloc nor contend on its locks. Blocks come in 64 byte classes up
+	// to 1 KiB, larger records go to operator new. The arena of an exited
+	// thread is handed to the next new thread with its blocks, so arenas
+	// are never freed and there are at most as many as threads at once.
+	class RecordArena {
+		struct alignas(std::max_align_t) Header {
+			RecordArena* arena;
+			Header* next;
+			size_t sizeClass;
+		};
+		static const size_t classBytes = 64;
+		static const size_t classes = 16;
+		// owner thread only
+		Header* local[classes] = {};
+		// blocks freed by other threads, the owner takes a whole list at once
+		std::atomic<Header*> returned[classes];
+		RecordArena* nextOrphan = nullptr;
+
+		RecordArena() {
+			for(auto& list : returned) {
+				list.store(nullptr, std::memory_order_relaxed);
+			}
+		}
+		static std::mutex& orphanMutex() {
+			static std::mutex mutex;
+			return mutex;
+		}
+		static RecordArena*& orphans() {
+			static RecordArena* list = nullptr;
+			return list;
+		}
+		static RecordArena*& self() {
+			static thread_local RecordArena* arena = nullptr;
+			return arena;
+		}
+		struct Owner {
+			~Owner() {
+				if(RecordArena* arena = self()) {
+					std::lock_guard<std::mutex> lock(orphanMutex());
+					arena->nextOrphan = orphans();
+					orphans() = arena;
+					self() = nullptr;
+				}
+			}
+		};
+		static RecordArena& current() {
+			RecordArena*& arena = self();
+			if(!arena) {
+				static thread_local Owner owner;
+				(void)&owner;
+				std::lock_guard<std::mutex> lock(orphanMutex());
+				if((arena = orphans())) {
+					orphans() = arena->nextOrphan;
+				}
+				else {
+					arena = new RecordArena();
+				}
+			}
+			return *arena;
+		}
+	public:
+		static void* allocate(size_t size) {
+			size_t sizeClass = (sizeof(Header) + size - 1) / classBytes;
+			Header* block;
+			if(sizeClass >= classes) {
+				block = static_cast<Header*>(::operator new(sizeof(Header) + size));
+				block->arena = nullptr;
+				return block + 1;
+			}
+			RecordArena& arena = current();
+			block = arena.local[sizeClass];
+			if(!block) {
+				block = arena.returned[sizeClass].exchange(nullptr, std::memory_order_acquire);
+			}
+			if(block) {
+				arena.local[sizeClass] = block->next;
+				return block + 1;
+			}
+			block = static_cast<Header*>(::operator new((sizeClass + 1) * classBytes));
+			block->arena = &arena;
+			block->sizeClass = sizeClass;
+			return block + 1;
+		}
+		static void deallocate(void* p) {
+			Header* block = static_cast<Header*>(p) - 1;
+			RecordArena* arena = block->arena;
+			if(!arena) {
+				::operator delete(block);
+				return;
+			}
+			if(arena == self()) {
+				block->next = arena->local[block->sizeClass];
+				arena->local[block->sizeClass] = block;
+				return;
+			}
+			std::atomic<Header*>& list = arena->returned[block->sizeClass];
+			block->next = list.load(std::memory_order_relaxed);
+			while(!list.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {
+			}
+		}
+	};
+
+	// queued event of the lock-free queue, run also frees it
+	struct DeferredRecord {
+		std::atomic<DeferredRecord*> next;
+		void (*run)(DeferredRecord*, bool invoke);
+		// the emitter of the record, what runDeferredParallel orders by
+		const void* owner;
+		size_t key;
+		// holds a place in a bounded queue
+		bool counted;
+		// may run next to records of the same emitter
+		bool concurrent;
+		// a closure queued by the emitter, see DeferredClosure
+		bool closure;
+#ifdef EVENTEMITTER_STATS
+		int64_t queuedAt = statsClock();
+#endif
+		DeferredRecord() : next(nullptr), run(nullptr), owner(nullptr), key(0), counted(false), concurrent(false), closure(false) {}
+	};
+
+	template<typename Tuple>
+	class DeferredChannel {
+		friend class DeferredBase;
+	public:
+		typedef void (*Invoke)(void* owner, Tuple& args);
+		// concurrent when the owner's handlers are safe to run on several
+		// threads at once, DeferredOrder::none only splits such channels
+		DeferredChannel(void* _owner, Invoke _invoke, bool _concurrent = false) : owner(_owner), invoke(_invoke), isConcurrent(_concurrent) {}
+		DeferredChannel(const DeferredChannel&) = delete;
+	private:
+		void* owner;
+		Invoke invoke;
+		bool isConcurrent;
+		// a record runs only if no later one of the channel was queued
+		std::atomic<bool> coalescing{false};
+		std::atomic<uint64_t> latest{0};
+#ifdef EVENTEMITTER_STATS
+		AtomicHistogram residence;
+	public:
+		void addTo(StatsSnapshot& snapshot) const {
+			residence.addTo(snapshot.residence);
+		}
+	private:
+#else
+	public:
+		void addTo(StatsSnapshot&) const {}
+	private:
+#endif
+
+		struct Record : DeferredRecord {
+			DeferredChannel* channel;
+			Tuple args;
+			// 0 when not coalesced
+			uint64_t sequence = 0;
+			template<typename... Args> Record(DeferredChannel* _channel, Args&&... fargs) : channel(_channel), args(std::forward<Args>(fargs)...) {
+				this->run = &runRecord;
+				this->owner = DeferredOwner<Tuple>::of(_channel->owner, args);
+				this->key = DeferredKey<Tuple>::of(args);
+				this->concurrent = _channel->isConcurrent;
+				this->closure = DeferredOwner<Tuple>::closure;
+			}
+		};
+		struct Free {
+			void operator()(Record* record) const {
+				record->~Record();
+				RecordArena::deallocate(record);
+			}
+		};
+		template<typename... Args> static Record* create(Args&&... fargs) {
+			static_assert(alignof(Record) <= alignof(std::max_align_t), "over-aligned deferred arguments");
+			void* p = RecordArena::allocate(sizeof(Record));
+			try {
+				return new(p) Record(std::forward<Args>(fargs)...);
+			}
+			catch(...) {
+				RecordArena::deallocate(p);
+				throw;
+			}
+		}
+		static void runRecord(DeferredRecord* base, bool invoke) {
+			std::unique_ptr<Record, Free> record(static_cast<Record*>(base));
+			if(invoke && (record->sequence == 0 || record->sequence == record->channel->latest.load())) {
+#ifdef EVENTEMITTER_STATS
+				record->channel->residence.record(statsClock() - record->queuedAt);
+#endif
+				record->channel->invoke(record->channel->owner, record->args);
+			}
+		}
+	};
+
+	// Vyukov's intrusive multi-producer/single-consumer queue: push is one atomic
+	// exchange and never waits, pop is for a single consumer at a time
+	template<typename Node>
+	class MpscQueue {
+		std::atomic<Node*> head; // last pushed node
+		Node* tail;              // next node to pop
+		Node stub;
+	public:
+		MpscQueue() : head(&stub), tail(&stub) {}
+		MpscQueue(const MpscQueue&) = delete;
+
+		void push(Node* node) {
+			node->next.store(nullptr, std::memory_order_relaxed);
+			Node* prev = head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+		// nullptr when empty or when a producer is still linking its node in
+		Node* pop() {
+			Node* t = tail;
+			Node* next = t->next.load(std::memory_order_acquire);
+			if(t == &stub) {
+				if(!next) {
+					return nullptr;
+				}
+				tail = t = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+			if(next) {
+				tail = next;
+				return t;
+			}
+			if(t != head.load(std::memory_order_acquire)) {
+				return nullptr;
+			}
+			push(&stub);
+			next = t->next.load(std::memory_order_acquire);
+			if(next) {
+				tail = next;
+				return t;
+			}
+			return nullptr;
+		}
+		// the node pushed last, &stub when nothing was pushed since the last pop
+		Node* last() const {
+			return head.load(std::memory_order_acquire);
+		}
+		bool isStub(const Node* node) const {
+			return node == &stub;
+		}
+	};
+#endif
+
+	class DeferredBase {
+	protected:
+		typedef InplaceFunction<void ()> DeferredHandler;
+		std::forward_list<DeferredHandler> removeHandlers;
+	private:
+		static void runClosure(void*, DeferredClosure& closure) {
+			std::get<0>(closure)();
+		}
+		DeferredChannel<DeferredClosure> closures{nullptr, &runClosure};
+		// set while one runAllDeferred call owns the drained batch
+		bool draining = false;
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		// held by the consumer running events, see Turn
+		std::mutex turnMutex;
+		// set while runDeferredParallel runs a batch on several threads
+		bool parallel = false;
+#endif
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+		DeferredMutex queueMutex;
+		// one entry per queued event, in trigger order
+		Ring<DeferredSink*> tokens;
+		Ring<DeferredSink*> drainTokens;
+		// channels which may have events in their pending buffer
+		Vector<DeferredSink*> pendingSinks;
+		// channels detached by runDeferredParallel
+		Vector<DeferredSink*> batchSinks;
+		// bound on pending events, 0 for none
+		size_t capacity = 0;
+		DeferredOverflow overflow = DeferredOverflow::block;
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		std::condition_variable_any roomAvailable;
+		size_t roomWaiters = 0;
+#endif
+#else
+		MpscQueue<DeferredRecord> records;
+		std::mutex consumerMutex;
+		// records unlinked by runAllDeferred and not run yet
+		DeferredRecord* drained = nullptr;
+		std::atomic<size_t> capacity{0};
+		std::atomic<DeferredOverflow> overflow{DeferredOverflow::block};
+		// counted records not taken by a consumer yet
+		std::atomic<size_t> queued{0};
+		std::mutex roomMutex;
+		std::condition_variable roomAvailable;
+		std::atomic<size_t> roomWaiters{0};
+#endif
+#ifdef EVENTEMITTER_STATS
+		std::atomic<size_t> highWater{0};
+#ifdef __EVENTEMITTER_LOCKFREE_DEFERRED
+		std::atomic<size_t> statsDepth{0};
+#endif
+#endif
+		// depth is the number of events queued after one was added
+		void statsQueued(size_t depth) {
+#ifdef EVENTEMITTER_STATS
+			size_t seen = highWater.load(std::memory_order_relaxed);
+			while(depth > seen && !highWater.compare_exchange_weak(seen, depth, std::memory_order_relaxed)) {
+			}
+#else
+			(void)depth;
+#endif
+		}
+		// count records left the lock-free queue
+		void statsTaken(size_t count) {
+#if defined(EVENTEMITTER_STATS) && defined(__EVENTEMITTER_LOCKFREE_DEFERRED)
+			statsDepth -= count;
+#else
+			(void)count;
+#endif
+		}
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		// the queue the current thread runs events of, a trigger into it never
+		// blocks as the thread would wait for itself
+		static const DeferredBase*& consuming() {
+			static thread_local const DeferredBase* base = nullptr;
+			return base;
+		}
+		struct Consuming {
+			const DeferredBase* saved;
+			Consuming(const DeferredBase* base) : saved(consuming()) {
+				consuming() = base;
+			}
+			~Consuming() {
+				consuming() = saved;
+			}
+		};
+		// One consumer runs events at a time, from taking them until they
+		// have run; producers never wait for it. Handlers of the running
+		// consumer, on any of its threads, run events without taking a turn.
+		struct Turn {
+			DeferredBase& base;
+			bool held;
+			Turn(DeferredBase& _base) : base(_base), held(consuming() != &_base) {
+				if(held) {
+					base.turnMutex.lock();
+				}
+			}
+			~Turn() {
+				if(held) {
+					base.turnMutex.unlock();
+				}
+			}
+		};
+		// handlers of runDeferredParallel run on several threads, one of
+		// them running events would run them next to the rest of the batch
+		void checkNested(const Turn& turn) const {
+			if(!turn.held && parallel) {
+				throw std::logic_error("EventEmitter: handlers run by runDeferredParallel must not run or clear deferred events");
+			}
+		}
+#endif
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+		// queue mutex held, false when the event must be rejected
+		bool waitForRoom(DeferredLock& lock, bool wait) {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			if(!wait || consuming() == this) {
+				return false;
+			}
+			++roomWaiters;
+			roomAvailable.wait(lock, [this] {
+				return capacity == 0 || tokens.size() < capacity || overflow != DeferredOverflow::block;
+			});
+			--roomWaiters;
+			return capacity == 0 || tokens.size() < capacity;
+#else
+			(void)lock;
+			(void)wait;
+			return false;
+#endif
+		}
+		// queue mutex held
+		void roomFreed() {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			if(roomWaiters) {
+				roomAvailable.notify_all();
+			}
+#endif
+		}
+#else
+		bool reserveRoom(bool wait) {
+			for(;;) {
+				if(queued.fetch_add(1) < capacity.load(std::memory_order_relaxed)) {
+					return true;
+				}
+				--queued;
+				if(!wait || overflow.load(std::memory_order_relaxed) != DeferredOverflow::block || consuming() == this) {
+					return false;
+				}
+				std::unique_lock<std::mutex> lock(roomMutex);
+				++roomWaiters;
+				roomAvailable.wait_for(lock, std::chrono::milliseconds(1), [this] {
+					return queued.load() < capacity.load();
+				});
+				--roomWaiters;
+			}
+		}
+		void roomFreed(size_t count) {
+			if(count) {
+				queued -= count;
+			}
+			if(roomWaiters) {
+				std::lock_guard<std::mutex> lock(roomMutex);
+				roomAvailable.notify_all();
+			}
+		}
+#endif
+		template<typename Tuple, typename... Args> bool enqueue(bool wait, DeferredChannel<Tuple>& channel, Args&&... fargs) {
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			size_t key = DeferredKey<Tuple>::ofArgs(fargs...);
+			DeferredLock lock(queueMutex);
+			if(channel.coalescing && channel.coalesce(key, std::forward<Args>(fargs)...)) {
+				return true;
+			}
+			if(capacity && tokens.size() >= capacity) {
+				switch(overflow) {
+				case DeferredOverflow::block:
+					if(!waitForRoom(lock, wait)) {
+						return false;
+					}
+					break;
+				case DeferredOverflow::dropNewest:
+					return false;
+				case DeferredOverflow::dropOldest:
+					tokens.front()->dropPending();
+					tokens.pop_front();
+					break;
+				case DeferredOverflow::coalesce:
+					return channel.coalesce(key, std::forward<Args>(fargs)...);
+				}
+			}
+			channel.track(key);
+			if(!channel.listed) {
+				pendingSinks.push_back(&channel);
+				channel.listed = true;
+			}
+			channel.queued();
+			try {
+				channel.pending.emplace_back(std::forward<Args>(fargs)...);
+			} catch(...) {
+				channel.unqueued();
+				throw;
+			}
+			try {
+				tokens.emplace_back(&channel);
+			} catch(...) {
+				channel.pending.pop_back();
+				channel.unqueued();
+				throw;
+			}
+			channel.appended(key);
+			statsQueued(tokens.size());
+#else
+			bool counted = capacity.load(std::memory_order_relaxed) != 0;
+			if(counted && !reserveRoom(wait)) {
+				return false;
+			}
+			auto record = DeferredChannel<Tuple>::create(&channel, std::forward<Args>(fargs)...);
+			record->counted = counted;
+			if(!DeferredKey<Tuple>::keyed && channel.coalescing.load(std::memory_order_relaxed)) {
+				record->sequence = ++channel.latest;
+			}
+			records.push(record);
+#ifdef EVENTEMITTER_STATS
+			statsQueued(++statsDepth);
+#endif
+#endif
+			return true;
+		}
+	protected:
+		// queues f as an event of owner
+		void runDeferred(const void* owner, DeferredHandler f) {
+			pushDeferred(closures, std::move(f), owner);
+		}
+		// queues an event for channel, its argument tuple is built from fargs;
+		// false when a bounded queue rejected it
+		template<typename Tuple, typename... Args> bool pushDeferred(DeferredChannel<Tuple>& channel, Args&&... fargs) {
+			return enqueue(true, channel, std::forward<Args>(fargs)...);
+		}
+		// like pushDeferred but never waits for room
+		template<typename Tuple, typename... Args> bool tryPushDeferred(DeferredChannel<Tuple>& channel, Args&&... fargs) {
+			return enqueue(false, channel, std::forward<Args>(fargs)...);
+		}
+		// adds the residence of channel's events and the queue high-water mark
+		template<typename Tuple> void deferredStats(const DeferredChannel<Tuple>& channel, StatsSnapshot& snapshot) const {
+			channel.addTo(snapshot);
+#ifdef EVENTEMITTER_STATS
+			snapshot.queueHighWater = highWater.load(std::memory_order_relaxed);
+#endif
+		}
+		// while on, an event of channel overwrites its newest pending event
+		// (of the same key) in place instead of being appended. The lock-free
+		// queue still queues every event and runs only the newest one of a
+		// channel, it does not coalesce per key.
+		template<typename Tuple> void setCoalescing(DeferredChannel<Tuple>& channel, bool on) {
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			DeferredLock lock(queueMutex);
+#endif
+			channel.coalescing = on;
+		}
+		// runs f, which changes handlers, between drains: another thread
+		// waits for the running consumer's turn, handlers of the drain do not
+		template<typename F> decltype(auto) betweenDrains(F&& f) {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			Turn turn(*this);
+#endif
+			return f();
+		}
+	public:
+		DeferredBase() = default;
+		DeferredBase(const DeferredBase&) = delete;
+		DeferredBase& operator=(const DeferredBase&) = delete;
+#ifdef __EVENTEMITTER_LOCKFREE_DEFERRED
+		~DeferredBase() {
+			clearDeferred();
+		}
+#endif
+
+		void removeAllHandlers() {
+			for(auto& handler : removeHandlers) {
+				handler();
+			}
+		}
+		// Bounds the pending events to capacity (0 for no bound) and picks what
+		// a trigger into a full queue does. The queue's own buffers are
+		// allocated up front and emitters' buffers keep the size they grew
+		// to, so a producer at full speed does not allocate. The lock-free
+		// queue allocates each event and treats dropOldest and coalesce like
+		// dropNewest.
+		void setDeferredCapacity(size_t _capacity, DeferredOverflow _overflow = DeferredOverflow::block) {
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			DeferredLock lock(queueMutex);
+			capacity = _capacity;
+			overflow = _overflow;
+			if(capacity) {
+				tokens.reserve(capacity);
+				drainTokens.reserve(capacity);
+			}
+			roomFreed();
+#else
+			capacity = _capacity;
+			overflow = _overflow;
+			roomFreed(0);
+#endif
+		}
+		// drops the events not run yet, the rest of a batch started by
+		// runAllDeferred included; waits for a drain on another thread
+		void clearDeferred() {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			Turn turn(*this);
+			checkNested(turn);
+#endif
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			DeferredLock lock(queueMutex);
+			tokens.clear();
+			for(auto sink : pendingSinks) {
+				sink->clearPending();
+				sink->listed = false;
+			}
+			pendingSinks.clear();
+			drainTokens.clear();
+			for(auto sink : batchSinks) {
+				sink->clearDrained();
+			}
+			batchSinks.clear();
+			roomFreed();
+#else
+			std::lock_guard<std::mutex> guard(consumerMutex);
+			size_t counted = 0, taken = 0;
+			while(DeferredRecord* record = records.pop()) {
+				counted += record->counted;
+				++taken;
+				record->run(record, false);
+			}
+			roomFreed(counted);
+			statsTaken(taken);
+			while(DeferredRecord* record = drained) {
+				drained = record->next.load(std::memory_order_relaxed);
+				record->run(record, false);
+			}
+#endif
+		}
+		// runs the oldest event; the rest of a started batch, left by a throwing
+		// handler or a drain the handler runs in, comes before newer events
+		bool runDeferred() {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			Turn turn(*this);
+			checkNested(turn);
+			Consuming consuming(this);
+#endif
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			if(!drainTokens.empty()) {
+				DeferredSink* sink = drainTokens.front();
+				drainTokens.pop_front();
+				sink->runDrained();
+				return true;
+			}
+			DeferredLock lock(queueMutex);
+			if(tokens.empty()) {
+				return false;
+			}
+			DeferredSink* sink = tokens.front();
+			tokens.pop_front();
+			roomFreed();
+			sink->runPending(lock);
+#else
+			if(DeferredRecord* record = drained) {
+				drained = record->next.load(std::memory_order_relaxed);
+				record->run(record, true);
+				return true;
+			}
+			DeferredRecord* record;
+			{
+				std::lock_guard<std::mutex> guard(consumerMutex);
+				record = records.pop();
+			}
+			if(!record) {
+				return false;
+			}
+			roomFreed(record->counted);
+			statsTaken(1);
+			record->run(record, true);
+#endif
+			return true;
+		}
+		// Takes the whole pending batch under one lock and runs it without holding
+		// the lock, events queued by the handlers are picked up by the next round.
+		// Calls from other threads wait for the drain to finish, nested calls
+		// from its handlers run events one by one instead.
+		void runAllDeferred() {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			Turn turn(*this);
+			checkNested(turn);
+#endif
+			ConsumerLock lock(batchMutex());
+			if(draining) {
+				lock.unlock();
+				while(runDeferred());
+				return;
+			}
+			Drain drain{*this, lock};
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			Consuming consuming(this);
+#endif
+			while(takeBatch()) {
+				lock.unlock();
+				runBatch();
+				lock.lock();
+			}
+		}
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		// Like runAllDeferred but the batch is run by up to threads threads of
+		// pool, the caller included (0 for all of them). order picks which
+		// events keep their trigger order; events of different emitters or keys
+		// may run at the same time, so their handlers must be thread safe and
+		// handlers of a dispatcher must not add event names while it runs.
+		// Every event runs even if a handler throws, the first exception is
+		// rethrown afterwards. Handlers must not run or clear deferred events of
+		// this queue while the batch runs, runDeferred, runAllDeferred,
+		// runDeferredParallel and clearDeferred throw std::logic_error in them.
+		void runDeferredParallel(ThreadPool& pool, size_t threads = 0, DeferredOrder order = DeferredOrder::perEmitter) {
+			if(threads == 0) {
+				threads = pool.size() + 1;
+			}
+			if(threads == 1) {
+				runAllDeferred();
+				return;
+			}
+			Turn turn(*this);
+			checkNested(turn);
+			ConsumerLock lock(batchMutex());
+			if(draining) {
+				lock.unlock();
+				while(runDeferred());
+				return;
+			}
+			Drain drain{*this, lock};
+			Consuming consuming(this);
+			// leftovers of a batch interrupted by a throwing handler go first
+			if(batchStarted()) {
+				lock.unlock();
+				runBatch();
+				lock.lock();
+			}
+			if(!takeBatch()) {
+				return;
+			}
+			lock.unlock();
+			struct Parallel {
+				bool& flag;
+				Parallel(bool& _flag) : flag(_flag) {
+					flag = true;
+				}
+				~Parallel() {
+					flag = false;
+				}
+			} parallelBatch{parallel};
+			runBatchParallel(pool, threads, order);
+		}
+#endif
+	private:
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+		typedef DeferredLock ConsumerLock;
+		DeferredMutex& batchMutex() {
+			return queueMutex;
+		}
+#else
+		typedef std::unique_lock<std::mutex> ConsumerLock;
+		std::mutex& batchMutex() {
+			return consumerMutex;
+		}
+#endif
+		// marks a batch as being drained, clears the mark with the lock held
+		struct Drain {
+			DeferredBase& base;
+			ConsumerLock& held;
+			Drain(DeferredBase& _base, ConsumerLock& _held) : base(_base), held(_held) {
+				base.draining = true;
+			}
+			~Drain() {
+				if(!held.owns_lock()) {
+					held.lock();
+				}
+				base.draining = false;
+			}
+		};
+		// consumer lock held
+		bool batchStarted() const {
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			return !drainTokens.empty();
+#else
+			return drained != nullptr;
+#endif
+		}
+		// takes the pending events as the next batch unless one is started,
+		// false when there is nothing to run, consumer lock held
+		bool takeBatch() {
+			if(batchStarted()) {
+				return true;
+			}
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			if(tokens.empty()) {
+				return false;
+			}
+			tokens.swap(drainTokens);
+			batchSinks.swap(pendingSinks);
+			pendingSinks.clear();
+			for(auto sink : batchSinks) {
+				sink->detach();
+				sink->listed = false;
+			}
+			roomFreed();
+			return true;
+#else
+			// unlink everything pushed before this point; the stub is last when
+			// a pop put it back behind records that were still being linked,
+			// which may follow it now, so then pop until the queue is empty
+			DeferredRecord* end = records.last();
+			if(records.isStub(end)) {
+				end = nullptr;
+			}
+			DeferredRecord* last = nullptr;
+			size_t counted = 0, taken = 0;
+			while(DeferredRecord* record = records.pop()) {
+				counted += record->counted;
+				++taken;
+				record->next.store(nullptr, std::memory_order_relaxed);
+				if(last) {
+					last->next.store(record, std::memory_order_relaxed);
+				}
+				else {
+					drained = record;
+				}
+				last = record;
+				if(record == end) {
+					break;
+				}
+			}
+			roomFreed(counted);
+			statsTaken(taken);
+			return drained != nullptr;
+#endif
+		}
+		// runs the batch in trigger order, without the lock
+		void runBatch() {
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			while(!drainTokens.empty()) {
+				DeferredSink* sink = drainTokens.front();
+				drainTokens.pop_front();
+				sink->runDrained();
+			}
+#else
+			while(DeferredRecord* record = drained) {
+				drained = record->next.load(std::memory_order_relaxed);
+				record->run(record, true);
+			}
+#endif
+		}
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		void runBatchParallel(ThreadPool& pool, size_t threads, DeferredOrder order) {
+			FirstError error;
+#ifndef __EVENTEMITTER_LOCKFREE_DEFERRED
+			// each emitter's events sit in its own buffer, so ordering per
+			// emitter is running each buffer on one thread; an emitter with
+			// events in more than one buffer, such as closures queued by its
+			// triggerXBatch, runs them all in trigger order on one thread
+			struct Part {
+				DeferredSink* sink;
+				size_t part;
+				size_t parts;
+				// by key, the events whose key maps to the part
+				const std::vector<size_t>* events;
+			};
+			std::unordered_map<const void*, size_t> buffers;
+			for(auto sink : batchSinks) {
+				if(sink->closures()) {
+					for(size_t i = 0;i < sink->drainedSize();++i) {
+						buffers[sink->drainedOwner(i)] = 2;
+					}
+				}
+				else if(sink->drainedSize() > 0) {
+					++buffers[sink->drainedOwner(0)];
+				}
+			}
+			std::vector<Part> parts;
+			// keyed buffers are dealt into buckets once, a part runs one
+			std::deque<std::vector<size_t>> buckets;
+			bool ordered = false;
+			for(auto sink : batchSinks) {
+				sink->ordered = sink->closures() || (sink->drainedSize() > 0 && buffers[sink->drainedOwner(0)] > 1);
+				sink->cursor = 0;
+				if(sink->ordered) {
+					ordered = true;
+				}
+				else if(order == DeferredOrder::none && sink->concurrent()) {
+					for(size_t part = 0;part < threads;++part) {
+						parts.push_back(Part{sink, part, threads, nullptr});
+					}
+				}
+				else if(order != DeferredOrder::perEmitter && sink->keyed()) {
+					std::vector<std::vector<size_t>> keys(threads);
+					sink->bucketDrained(keys.data(), threads);
+					for(auto& bucket : keys) {
+						if(!bucket.empty()) {
+							buckets.push_back(std::move(bucket));
+							parts.push_back(Part{sink, 0, 1, &buckets.back()});
+						}
+					}
+				}
+				else {
+					parts.push_back(Part{sink, 0, 1, nullptr});
+				}
+			}
+			// the events of such emitters in trigger order, one list each
+			std::vector<std::vector<std::pair<DeferredSink*, size_t>>> lists;
+			if(ordered) {
+				std::unordered_map<const void*, size_t> listOf;
+				for(size_t t = 0;t < drainTokens.size();++t) {
+					DeferredSink* sink = drainTokens[t];
+					if(!sink->ordered) {
+						continue;
+					}
+					size_t i = sink->cursor++;
+					auto found = listOf.emplace(sink->drainedOwner(i), lists.size());
+					if(found.second) {
+						lists.emplace_back();
+					}
+					lists[found.first->second].emplace_back(sink, i);
+				}
+			}
+			parallelFor(pool, parts.size() + lists.size(), [&](size_t i) {
+				Consuming consuming(this);
+				if(i < parts.size() && parts[i].events) {
+					parts[i].sink->runDrainedList(*parts[i].events, error);
+					return;
+				}
+				if(i < parts.size()) {
+					parts[i].sink->runDrainedPart(parts[i].part, parts[i].parts, error);
+					return;
+				}
+				for(auto& event : lists[i - parts.size()]) {
+					event.first->runDrainedAt(event.second, error);
+				}
+			}, threads);
+			drainTokens.clear();
+			for(auto sink : batchSinks) {
+				sink->clearDrained();
+			}
+#else
+			// deal the records into one list per thread, an emitter (and key)
+			// always lands in the same list; all records of an emitter which
+			// queued closures, such as its triggerXBatch, land in one list
+			std::unordered_set<const void*> whole;
+			if(order != DeferredOrder::perEmitter) {
+				for(DeferredRecord* record = drained;record;record = record->next.load(std::memory_order_relaxed)) {
+					if(record->closure) {
+						whole.insert(record->owner);
+					}
+				}
+			}
+			std::vector<DeferredRecord*> heads(threads, nullptr), tails(threads, nullptr);
+			size_t sequence = 0;
+			while(DeferredRecord* record = drained) {
+				drained = record->next.load(std::memory_order_relaxed);
+				record->next.store(nullptr, std::memory_order_relaxed);
+				bool split = order != DeferredOrder::perEmitter && (whole.empty() || !whole.count(record->owner));
+				uint64_t hash = uint64_t(reinterpret_cast<uintptr_t>(record->owner) >> 4);
+				if(split) {
+					hash ^= uint64_t(record->key) << 32 | record->key;
+				}
+				size_t list = split && order == DeferredOrder::none && record->concurrent ? sequence++ % threads : size_t((hash * 0x9E3779B97F4A7C15ull) >> 33) % threads;
+				if(tails[list]) {
+					tails[list]->next.store(record, std::memory_order_relaxed);
+				}
+				else {
+					heads[list] = record;
+				}
+				tails[list] = record;
+			}
+			parallelFor(pool, threads, [&](size_t list) {
+				Consuming consuming(this);
+				for(DeferredRecord* record = heads[list];record;) {
+					DeferredRecord* next = record->next.load(std::memory_order_relaxed);
+					try {
+						record->run(record, true);
+					}
+					catch(...) {
+						error.capture();
+					}
+					record = next;
+				}
+			}, threads);
+#endif
+			if(error.error) {
+				std::rethrow_exception(error.error);
+			}
+		}
+#endif
+	};
+
+	// The top bit of a handle marks a handler that runs once.
+	constexpr handle_id_type onceHandleFlag = handle_id_type(1) << 63;
+
+	// Handlers in one dense array, in the order they were added, with their
+	// handles in a parallel array. Emitting is a linear scan over contiguous
+	// memory; removal leaves a tombstone (a zero handle) which is compacted
+	// away once tombstones outnumber live handlers.
+	// A handle is a slot number in its low 32 bits and the slot's generation
+	// above that. The slot records where its handler sits in the dense array,
+	// so removal is a lookup rather than a search, and freeing a slot bumps
+	// its generation so stale handles no longer match. A slot whose
+	// generation runs out is retired instead of wrapping around, so a
+	// handle is never handed out twice.
+	// Handlers may add and remove handlers while an emit is running: removed
+	// handlers are skipped but kept alive and added ones are parked until the
+	// outermost emit returns, when both are settled. Once handlers are
+	// removed before they run, so a nested emit does not run them again.
+	template<typename Handler>
+	class HandlerVector {
+		struct Slot {
+			uint32_t index; // in the dense array, or the next free slot
+			uint32_t generation;
+		};
+		struct EmitScope {
+			HandlerVector& owner;
+			EmitScope(HandlerVector& _owner) : owner(_owner) {
+				++owner.depth;
+			}
+			~EmitScope() {
+				if(--owner.depth == 0 && owner.changed) {
+					owner.settle();
+				}
+			}
+		};
+		static const uint32_t noSlot = uint32_t(-1);
+		// 31 bits, the top bit of a handle is onceHandleFlag
+		static const uint32_t lastGeneration = 0x7fffffff;
+		// sorted by descending priority, in registration order within one
+		Vector<Handler> handlers;
+		Vector<handle_id_type> handles;
+		Vector<int> priorities;
+		Vector<Slot> slots;
+		// handlers added during an emit, they are placed by settle
+		Vector<Handler> added;
+		Vector<handle_id_type> addedHandles;
+		Vector<int> addedPriorities;
+		uint32_t freeSlots = noSlot;
+		uint32_t depth = 0;
+		bool changed = false;
+		size_t live = 0;
+#ifdef EVENTEMITTER_STATS
+		EmitStats emitStats;
+#endif
+
+		static uint32_t slotOf(handle_id_type handle) {
+			return uint32_t(handle);
+		}
+		handle_id_type& handleAt(size_t i) {
+			return i < handles.size() ? handles[i] : addedHandles[i - handles.size()];
+		}
+		void tombstone(size_t i) {
+			handle_id_type& handle = handleAt(i);
+			Slot& slot = slots[slotOf(handle)];
+			// generations start at 1 so no live handle is zero
+			if(slot.generation == lastGeneration) {
+				slot.index = noSlot;
+			}
+			else {
+				slot.index = freeSlots;
+				slot.generation++;
+				freeSlots = slotOf(handle);
+			}
+			handle = 0;
+			--live;
+			if(depth) {
+				changed = true;
+			}
+			else {
+				handlers[i] = nullptr;
+			}
+		}
+		// appends unless priority is above the last one, then the handlers
+		// behind the new one move up
+		template<typename F> void place(F&& handler, handle_id_type handle, int priority) {
+			size_t i = handles.size();
+			if(i && priority > priorities.back()) {
+				i = std::upper_bound(priorities.begin(), priorities.end(), priority, std::greater<int>()) - priorities.begin();
+			}
+			handles.reserve(handles.size() + 1);
+			priorities.reserve(priorities.size() + 1);
+			handlers.emplace(handlers.begin() + i, std::forward<F>(handler));
+			handles.insert(handles.begin() + i, handle);
+			priorities.insert(priorities.begin() + i, priority);
+			for(size_t n = handles.size();i < n;++i) {
+				if(handles[i]) {
+					slots[slotOf(handles[i])].index = uint32_t(i);
+				}
+			}
+		}
+		void settle() {
+			changed = false;
+			for(size_t i = 0;i < added.size();++i) {
+				if(addedHandles[i]) {
+					place(std::move(added[i]), addedHandles[i], addedPriorities[i]);
+				}
+			}
+			added.clear();
+			addedHandles.clear();
+			addedPriorities.clear();
+			for(size_t i = 0;i < handlers.size();++i) {
+				if(!handles[i]) {
+					handlers[i] = nullptr;
+				}
+			}
+			compact();
+		}
+		void compact() {
+			if(live == 0) {
+				handlers.clear();
+				handles.clear();
+				priorities.clear();
+				return;
+			}
+			size_t dead = handlers.size() - live;
+			if(dead <= live || dead < 8) {
+				return;
+			}
+			size_t to = 0;
+			for(size_t from = 0;from < handlers.size();++from) {
+				if(handles[from]) {
+					if(to != from) {
+						handlers[to] = std::move(handlers[from]);
+						handles[to] = handles[from];
+						priorities[to] = priorities[from];
+						slots[slotOf(handles[to])].index = uint32_t(to);
+					}
+					++to;
+				}
+			}
+			handlers.resize(to);
+			handles.resize(to);
+			priorities.resize(to);
+		}
+	public:
+		// higher priorities run first, equal ones in the order they were added
+		template<typename F> handle_id_type add(F&& handler, bool once = false, int priority = 0) {
+			uint32_t slot = freeSlots;
+			if(slot == noSlot) {
+				slot = uint32_t(slots.size());
+				slots.push_back(Slot{0, 1});
+			}
+			else {
+				freeSlots = slots[slot].index;
+			}
+			handle_id_type handle = slot | handle_id_type(slots[slot].generation) << 32 | (once ? onceHandleFlag : 0);
+			if(depth) {
+				// growing handlers now would move the running handler
+				slots[slot].index = uint32_t(handles.size() + addedHandles.size());
+				added.emplace_back(std::forward<F>(handler));
+				addedHandles.push_back(handle);
+				addedPriorities.push_back(priority);
+				changed = true;
+			}
+			else {
+				place(std::forward<F>(handler), handle, priority);
+			}
+			++live;
+			return handle;
+		}
+		bool remove(handle_id_type handle) {
+			uint32_t slot = slotOf(handle);
+			if(!handle || slot >= slots.size()) {
+				return false;
+			}
+			uint32_t i = slots[slot].index;
+			if(i >= handles.size() + addedHandles.size() || handleAt(i) != handle) {
+				return false;
+			}
+			tombstone(i);
+			if(!depth) {
+				compact();
+			}
+			return true;
+		}
+		void clear() {
+			for(size_t i = 0, n = handles.size() + addedHandles.size();i < n;++i) {
+				if(handleAt(i)) {
+					tombstone(i);
+				}
+			}
+			if(!depth) {
+				handlers.clear();
+				handles.clear();
+				priorities.clear();
+			}
+		}
+		size_t size() const {
+			return live;
+		}
+		bool empty() const {
+			return live == 0;
+		}
+		bool emitting() const {
+			return depth != 0;
+		}
+		StatsSnapshot stats() const {
+			StatsSnapshot snapshot;
+			snapshot.handlers = live;
+#ifdef EVENTEMITTER_STATS
+			emitStats.addTo(snapshot);
+#endif
+			return snapshot;
+		}
+		template<typename... Args> void emit(Args&&... fargs) {
+			EmitScope scope(*this);
+#ifdef EVENTEMITTER_STATS
+			EmitStats::Emit timing(emitStats);
+#endif
+			for(size_t i = 0, n = handlers.size();i < n;++i) {
+				handle_id_type handle = handles[i];
+				if(!handle) {
+					continue;
+				}
+				if(handle & onceHandleFlag) {
+					tombstone(i);
+				}
+#ifdef EVENTEMITTER_STATS
+				timing.handler([&] {
+					handlers[i](fargs...);
+				});
+#else
+				handlers[i](fargs...);
+#endif
+			}
+		}
+		// handler-major: each handler runs over all events before the next
+		// one starts, a once handler gets the first event only
+		template<typename Tuple> void emitBatch(const Tuple* events, size_t count) {
+			if(count == 0) {
+				return;
+			}
+			EmitScope scope(*this);
+#ifdef EVENTEMITTER_STATS
+			EmitStats::Emit timing(emitStats, count);
+#endif
+			for(size_t i = 0, n = handlers.size();i < n;++i) {
+				handle_id_type handle = handles[i];
+				if(!handle) {
+					continue;
+				}
+				if(handle & onceHandleFlag) {
+					tombstone(i);
+					applyTuple(handlers[i], events[0]);
+					continue;
+				}
+				// a handler that removes itself stops at once
+				for(size_t e = 0;e < count && handles[i];++e) {
+#ifdef EVENTEMITTER_STATS
+					timing.handler([&] {
+						applyTuple(handlers[i], events[e]);
+					});
+#else
+					applyTuple(handlers[i], events[e]);
+#endif
+				}
+			}
+		}
+	};
+	
+	// Emitter over a fixed set of handlers known at compile time. The
+	// handlers are kept by value in a tuple and trigger calls each of them
+	// directly, in the order they were given, so the compiler can inline
+	// them: no type erasure, no handler array, nothing to allocate. on
+	// returns a new emitter with one more handler.
+	template<typename... Handlers>
+	class StaticEventEmitter {
+		std::tuple<Handlers...> handlers;
+
+		template<typename... Args, size_t... I> void emitAll(std::index_sequence<I...>, Args&... fargs) {
+			(void)std::initializer_list<int>{((void)std::get<I>(handlers)(fargs...), 0)...};
+		}
+		template<typename F, size_t... I> StaticEventEmitter<Handlers..., std::decay_t<F>> append(F&& handler, std::index_sequence<I...>) && {
+			return StaticEventEmitter<Handlers..., std::decay_t<F>>(std::get<I>(std::move(handlers))..., std::forward<F>(handler));
+		}
+	public:
+		explicit StaticEventEmitter(Handlers... _handlers) : handlers(std::move(_handlers)...) {}
+
+		template<typename F> StaticEventEmitter<Handlers..., std::decay_t<F>> on(F&& handler) && {
+			return std::move(*this).append(std::forward<F>(handler), std::index_sequence_for<Handlers...>());
+		}
+		template<typename F> StaticEventEmitter<Handlers..., std::decay_t<F>> on(F&& handler) const& {
+			return StaticEventEmitter(*this).on(std::forward<F>(handler));
+		}
+		bool hasHandlers() const {
+			return sizeof...(Handlers) != 0;
+		}
+		int countHandlers() const {
+			return sizeof...(Handlers);
+		}
+		template<size_t I> decltype(auto) handler() {
+			return std::get<I>(handlers);
+		}
+		template<typename... Args> inline void emit(Args&&... fargs) {
+			trigger(std::forward<Args>(fargs)...);
+		}
+		// every handler gets the same argument objects, as lvalues
+		template<typename... Args> void trigger(Args&&... fargs) {
+			emitAll(std::index_sequence_for<Handlers...>(), fargs...);
+		}
+	};
+
+	template<typename... Handlers>
+	StaticEventEmitter<std::decay_t<Handlers>...> makeStaticEmitter(Handlers&&... handlers) {
+		return StaticEventEmitter<std::decay_t<Handlers>...>(std::forward<Handlers>(handlers)...);
+	}
+
+	// One-shot waiters for the next event of an emitter: waitX, futureOnceX
+	// and awaiting coroutines queue a Waiter instead of adding a handler, so
+	// waiting neither allocates nor copies the handlers. The next event takes
+	// the whole queue and fires the waiters in the order they came with no
+	// lock held, so a waiter may queue again from inside fire. A waiter that
+	// throws does not stop the others, the first exception is rethrown
+	// once all have fired.
+	template<typename... Args>
+	class WaiterList {
+	public:
+		struct Waiter {
+			// true when the waiter goes to the idle list for reuse
+			bool (*fire)(Waiter*, HandlerArg<Args>...) = nullptr;
+			// frees a pooled waiter the list still holds when destroyed
+			void (*release)(Waiter*) = nullptr;
+			Waiter* next = nullptr;
+		};
+	private:
+		DeferredMutex lock;
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		std::atomic<Waiter*> head{nullptr};
+#else
+		Waiter* head = nullptr;
+#endif
+		Waiter* idle = nullptr;
+
+		Waiter* first() const {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			return head.load(std::memory_order_acquire);
+#else
+			return head;
+#endif
+		}
+		void setFirst(Waiter* waiter) {
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			head.store(waiter, std::memory_order_release);
+#else
+			head = waiter;
+#endif
+		}
+	public:
+		WaiterList() {}
+		WaiterList(const WaiterList&) = delete;
+		// detaches the waiters first, so a concurrent remove finds none
+		~WaiterList() {
+			Waiter* queued;
+			{
+				DeferredLock guard(lock);
+				queued = first();
+				setFirst(nullptr);
+			}
+			for(Waiter* waiter : {queued, idle}) {
+				while(waiter) {
+					Waiter* next = waiter->next;
+					if(waiter->release) {
+						waiter->release(waiter);
+					}
+					waiter = next;
+				}
+			}
+		}
+		void push(Waiter* waiter) {
+			DeferredLock guard(lock);
+			waiter->next = first();
+			setFirst(waiter);
+		}
+		// false when an event has taken the waiter already
+		bool remove(Waiter* waiter) {
+			DeferredLock guard(lock);
+			Waiter* w = first();
+			if(w == waiter) {
+				setFirst(waiter->next);
+				return true;
+			}
+			for(;w;w = w->next) {
+				if(w->next == waiter) {
+					w->next = waiter->next;
+					return true;
+				}
+			}
+			return false;
+		}
+		// a fired waiter that asked to be reused, nullptr if none
+		Waiter* reuse() {
+			DeferredLock guard(lock);
+			Waiter* waiter = idle;
+			if(waiter) {
+				idle = waiter->next;
+			}
+			return waiter;
+		}
+		template<typename... FArgs> void fire(FArgs&... fargs) {
+			if(!first()) {
+				return;
+			}
+			Waiter* taken;
+			{
+				DeferredLock guard(lock);
+				taken = first();
+				setFirst(nullptr);
+			}
+			Waiter* queued = nullptr;
+			while(taken) {
+				Waiter* next = taken->next;
+				taken->next = queued;
+				queued = taken;
+				taken = next;
+			}
+			Waiter* fired = nullptr;
+			Waiter* firedTail = nullptr;
+			std::exception_ptr error;
+			while(queued) {
+				// most waiters may be gone as soon as they are fired
+				Waiter* next = queued->next;
+				void (*release)(Waiter*) = queued->release;
+				bool reuse = false;
+				try {
+					reuse = queued->fire(queued, fargs...);
+				}
+				catch(...) {
+					if(!error) {
+						error = std::current_exception();
+					}
+					// the list holds it no more, a pooled one is freed
+					if(release) {
+						release(queued);
+					}
+				}
+				if(reuse) {
+					queued->next = fired;
+					fired = queued;
+					firedTail = firedTail ? firedTail : queued;
+				}
+				queued = next;
+			}
+			if(fired) {
+				DeferredLock guard(lock);
+				firedTail->next = idle;
+				idle = fired;
+			}
+			if(error) {
+				std::rethrow_exception(error);
+			}
+		}
+	};
+
+	// awaitables of nextX() and streamX(), complete with C++20 coroutines
+	struct InlineResume;
+	template<typename Executor, typename... Args> class NextEvent;
+	template<typename Executor, typename... Args> class EventStream;
+
+#ifdef __EVENTEMITTER_COROUTINES
+	// resumes an awaiting coroutine on the thread running the event
+	struct InlineResume {
+		void operator()(std::coroutine_handle<> handle) const {
+			handle.resume();
+		}
+	};
+#ifndef EVENTEMITTER_DISABLE_THREADING
+	// resumes an awaiting coroutine on a worker of the pool
+	struct PoolResume {
+		ThreadPool* pool;
+		void operator()(std::coroutine_handle<> handle) const {
+			pool->post([handle] {
+				handle.resume();
+			});
+		}
+	};
+#endif
+
+	// co_await yields the arguments of the next event as a tuple. The
+	// awaiter lives in the coroutine frame, so awaiting allocates nothing;
+	// destroying a suspended coroutine takes it off the queue, or waits for
+	// an event on another thread which took it already to let go of it.
+	template<typename Executor, typename... Args>
+	class NextEvent : WaiterList<Args...>::Waiter {
+		typedef typename WaiterList<Args...>::Waiter Waiter;
+		typedef std::tuple<std::decay_t<Args>...> Tuple;
+		// cancelled by the destructor before an event takes the waiter,
+		// fired once the event no longer touches it
+		enum State : unsigned char { waiting, cancelled, firing, fired };
+		WaiterList<Args...>& list;
+		Executor executor;
+		std::coroutine_handle<> handle;
+		std::optional<Tuple> args;
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		std::atomic<State> state{waiting};
+#else
+		State state = waiting;
+#endif
+
+		static bool fireNext(Waiter* waiter, HandlerArg<Args>... fargs) {
+			NextEvent* self = static_cast<NextEvent*>(waiter);
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			State expected = waiting;
+			if(!self->state.compare_exchange_strong(expected, firing)) {
+				self->state.store(fired, std::memory_order_release);
+				return false;
+			}
+#endif
+			try {
+				self->args.emplace(fargs...);
+			}
+			catch(...) {
+				self->state = fired;
+				throw;
+			}
+			Executor executor = self->executor;
+			std::coroutine_handle<> handle = self->handle;
+			self->state = fired;
+			executor(handle);
+			return false;
+		}
+	public:
+		NextEvent(WaiterList<Args...>& _list, Executor _executor) : list(_list), executor(std::move(_executor)) {
+			this->fire = &fireNext;
+		}
+		NextEvent(const NextEvent&) = delete;
+		~NextEvent() {
+			if(!handle || state == fired || list.remove(this)) {
+				return;
+			}
+#ifndef EVENTEMITTER_DISABLE_THREADING
+			State expected = waiting;
+			state.compare_exchange_strong(expected, cancelled);
+			while(state.load(std::memory_order_acquire) != fired) {
+				std::this_thread::yield();
+			}
+#endif
+		}
+		bool await_ready() const noexcept {
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> _handle) {
+			handle = _handle;
+			list.push(this);
+		}
+		Tuple await_resume() {
+			return std::move(*args);
+		}
+	};
+
+	// Every event since streamX() in order, co_await stream.next() takes
+	// the oldest one or suspends until the next comes. Events wait in a
+	// buffer that grows to the longest backlog, after that awaiting
+	// allocates nothing. One coroutine awaits a stream at a time, and
+	// destroying the stream stops the subscription.
+	template<typename Executor, typename... Args>
+	class EventStream {
+		typedef std::tuple<std::decay_t<Args>...> Tuple;
+	public:
+		class Next;
+		// shared with the subscribed handler, which may outlive the stream
+		class State {
+			friend class Next;
+			DeferredMutex lock;
+			Ring<Tuple> buffer;
+			Next* waiting = nullptr;
+			Executor executor;
+		public:
+			explicit State(Executor _executor) : executor(std::move(_executor)) {}
+			void push(HandlerArg<Args>... fargs) {
+				DeferredLock guard(lock);
+				Next* next = waiting;
+				if(!next) {
+					buffer.emplace_back(fargs...);
+					return;
+				}
+				waiting = nullptr;
+				// under the lock, the awaiter may be destroyed once it is free
+				next->args.emplace(fargs...);
+				std::coroutine_handle<> handle = next->handle;
+				guard.unlock();
+				executor(handle);
+			}
+		};
+		class Next {
+			friend class State;
+			State& state;
+			std::coroutine_handle<> handle;
+			std::optional<Tuple> args;
+		public:
+			explicit Next(State& _state) : state(_state) {}
+			Next(const Next&) = delete;
+			~Next() {
+				if(handle) {
+					DeferredLock guard(state.lock);
+					if(state.waiting == this) {
+						state.waiting = nullptr;
+					}
+				}
+			}
+			// the lock is held from an empty buffer until await_suspend
+			bool await_ready() {
+				state.lock.lock();
+				if(state.buffer.empty()) {
+					return false;
+				}
+				args.emplace(std::move(state.buffer.front()));
+				state.buffer.pop_front();
+				state.lock.unlock();
+				return true;
+			}
+			void await_suspend(std::coroutine_handle<> _handle) {
+				handle = _handle;
+				state.waiting = this;
+				state.lock.unlock();
+			}
+			Tuple await_resume() {
+				return std::move(*args);
+			}
+		};
+		// subscribe gets the shared state and returns what unsubscribes
+		template<typename Subscribe> EventStream(Executor executor, Subscribe&& subscribe)
+			: state(std::allocate_shared<State>(Allocator<State>(), std::move(executor))), unsubscribe(subscribe(state)) {}
+		EventStream(EventStream&&) = default;
+		~EventStream() {
+			if(unsubscribe) {
+				unsubscribe();
+			}
+		}
+		Next next() {
+			return Next(*state);
+		}
+	private:
+		std::shared_ptr<State> state;
+		InplaceFunction<void()> unsubscribe;
+	};
+#endif
+
+	// Interned keys with a value each, looked up through an open addressing
+	// table with linear probing. Ids index a deque so they stay valid and
+	// values never move as keys are added. Keys are never removed.
+	template<typename Key, typename Value>
+	class EventTable {
+		struct Entry {
+			Key key;
+			Value value;
+			Entry(const Key& _key) : key(_key) {}
+		};
+		std::deque<Entry, Allocator<Entry>> entries;
+		// hash in the high half, id + 1 in the low half, zero when empty
+		Vector<uint64_t> index;
+
+		static uint32_t hashOf(const Key& key) {
+			size_t hash = std::hash<Key>()(key);
+			return uint32_t(hash ^ (uint64_t(hash) >> 32));
+		}
+		void grow() {
+			Vector<uint64_t> old(index.size() ? index.size() * 2 : 16, 0);
+			old.swap(index);
+			size_t mask = index.size() - 1;
+			for(uint64_t bucket : old) {
+				if(bucket) {
+					size_t i = size_t(bucket >> 32) & mask;
+					while(index[i]) {
+						i = (i + 1) & mask;
+					}
+					index[i] = bucket;
+				}
+			}
+		}
+	public:
+		EventId find(const Key& key) const {
+			if(index.empty()) {
+				return noEventId;
+			}
+			uint32_t hash = hashOf(key);
+			size_t mask = index.size() - 1;
+			for(size_t i = hash & mask;index[i];i = (i + 1) & mask) {
+				if(uint32_t(index[i] >> 32) == hash) {
+					EventId id = EventId(index[i]) - 1;
+					if(entries[id].key == key) {
+						return id;
+					}
+				}
+			}
+			return noEventId;
+		}
+		EventId intern(const Key& key) {
+			EventId id = find(key);
+			if(id != noEventId) {
+				return id;
+			}
+			// keep the load factor at or below 3/4
+			if((entries.size() + 1) * 4 > index.size() * 3) {
+				grow();
+			}
+			id = EventId(entries.size());
+			entries.emplace_back(key);
+			uint32_t hash = hashOf(key);
+			size_t mask = index.size() - 1;
+			size_t i = hash & mask;
+			while(index[i]) {
+				i = (i + 1) & mask;
+			}
+			index[i] = uint64_t(hash) << 32 | (id + 1);
+			return id;
+		}
+		Value& operator[](EventId id) {
+			return entries[id].value;
+		}
+		size_t size() const {
+			return entries.size();
+		}
+	};
+
+	// The name table of a dispatcher over Emitter: an EventTable of
+	// Container, or a ShardedEventTable of handler snapshots when Emitter
+	// runs its handlers on several threads at once.
+	template<typename Emitter, typename Key, typename Container, typename = void> struct DispatcherEvents {
+		typedef EventTable<Key, Container> type;
+	};
+
+	// reference_wrapper needs to be used instead of std::reference_wrapper
+	// this is because of VS2013 (RC) bug
+	template<class T> class reference_wrapper
+	{
+	public:
+		typedef T type;
+		explicit reference_wrapper(T& t): t_(&t) {}
+		operator T& () const { return *t_; }
+		T& get() const { return *t_; }
+		T* get_pointer() const { return t_; }
+private:
+    T* t_;
+};
+	
+
+// source: stackoverflow.com/questions/15501301/binding-function-arguments-in-c11
+template<typename T> struct forward_as_ref_type {
+ typedef T &&type;
+};
+template<typename T> struct forward_as_ref_type<T &> {
+	typedef reference_wrapper<T> type;
+};
+template<typename T> typename forward_as_ref_type<T>::type forward_as_ref(
+ typename std::remove_reference<T>::type &t) {
+    return static_cast<typename forward_as_ref_type<T>::type>(t);
+ }
+ template<typename T> T &&forward_as_ref(
+ typename std::remove_reference<T>::type &&t) {
+    return t;
+ }
+
+template<typename... Args, size_t Size>
+inline decltype(auto) wrapLambdaWithCallback(const InplaceFunction<void(Args...), Size>& f, std::function<void()>&& afterCb) {
+	return [=,afterCb=std::move(afterCb)](HandlerArg<Args>... args) {
+		f(args...);
+		afterCb();
+	};
+}
+
+template<typename... Args, size_t Size>
+inline decltype(auto) wrapLambdaWithCallback(InplaceFunction<void(Args...), Size>&& f, std::function<void()>&& afterCb) {
+	return [f=std::move(f),afterCb=std::move(afterCb)](HandlerArg<Args>... args) {
+		f(args...);
+		afterCb();
+	};
+}
+
+#ifndef EVENTEMITTER_DISABLE_THREADING
+
+	// Parks a thread until another one wakes it. The waiter spins on the
+	// flag for a moment before it sleeps, so a wake that comes quickly
+	// costs it no system call. The waker sets the flag under the slot's
+	// mutex, which keeps the slot alive until the waker is done with it.
+	// Each thread reuses its own slot, so waiting allocates nothing.
+	class WaitSlot {
+		std::atomic<bool> woken{false};
+		std::mutex m;
+		std::condition_variable condition;
+	public:
+		static WaitSlot& local() {
+			static thread_local WaitSlot slot;
+			return slot;
+		}
+		~WaitSlot() {
+			std::lock_guard<std::mutex> lock(m);
+		}
+		void reset() {
+			woken.store(false, std::memory_order_relaxed);
+		}
+		void wake() {
+			std::lock_guard<std::mutex> lock(m);
+			woken.store(true, std::memory_order_release);
+			condition.notify_one();
+		}
+		// false when the duration passed first, milliseconds::max() waits
+		// for good; the flag is the predicate, so spurious wakeups go on
+		// waiting
+		bool waitFor(std::chrono::milliseconds duration) {
+			for(int spin = 0;spin < 64;++spin) {
+				if(woken.load(std::memory_order_acquire)) {
+					return true;
+				}
+				std::this_thread::yield();
+			}
+			std::unique_lock<std::mutex> lock(m);
+			auto isWoken = [this] {
+				return woken.load(std::memory_order_relaxed);
+			};
+			if(duration == std::chrono::milliseconds::max()) {
+				condition.wait(lock, isWoken);
+				return true;
+			}
+			return condition.wait_for(lock, duration, isWoken);
+		}
+	};
+
+	// Epoch based reclamation shared by all snapshot handler lists. A reader
+	// publishes the global epoch in its own record before it reads a
+	// snapshot and clears it when done. A writer swaps in a new snapshot,
+	// notes the epoch with the old one, and may free it once no reader
+	// shows an epoch at or below that. Readers only write their own cache
+	// line, so concurrent emits do not contend; writers only advance the
+	// epoch when they reclaim, once per retireBatch retired objects of a
+	// list, so writers of unrelated lists rarely touch it.
+	class EpochDomain {
+		struct Reader {
+			std::atomic<uint64_t> epoch; // 0 when outside any read section
+			std::atomic<bool> used;
+			unsigned depth = 0;
+			Reader* next = nullptr;
+			char pad[64];
+			Reader() : epoch(0), used(true) {}
+		};
+		// records are recycled when their thread exits and never freed
+		struct LocalReader {
+			Reader* reader;
+			LocalReader() : reader(instance().acquire()) {}
+			~LocalReader() {
+				reader->used.store(false, std::memory_order_release);
+			}
+		};
+		std::atomic<uint64_t> epoch;
+		std::atomic<Reader*> readers;
+
+		EpochDomain() : epoch(1), readers(nullptr) {}
+		Reader* acquire() {
+			for(Reader* r = readers.load();r;r = r->next) {
+				bool unused = false;
+				if(!r->used.load(std::memory_order_relaxed) && r->used.compare_exchange_strong(unused, true)) {
+					return r;
+				}
+			}
+			Reader* r = allocateObject<Reader>();
+			r->next = readers.load();
+			while(!readers.compare_exchange_weak(r->next, r)) {
+			}
+			return r;
+		}
+		static Reader& local() {
+			static thread_local LocalReader local;
+			return *local.reader;
+		}
+	public:
+		static EpochDomain& instance() {
+			static EpochDomain domain;
+			return domain;
+		}
+		// read sections nest, only the outermost one publishes an epoch
+		void enter() {
+			Reader& r = local();
+			if(r.depth++ == 0) {
+				r.epoch.store(epoch.load());
+			}
+		}
+		void leave() {
+			Reader& r = local();
+			if(--r.depth == 0) {
+				r.epoch.store(0, std::memory_order_release);
+			}
+		}
+		// small, so objects freed in one go still fit the allocator's
+		// per-thread cache
+		static const size_t retireBatch = 4;
+		// call after unpublishing object, queues it on the list's retired
+		// (epoch, object) pairs; every retireBatch objects, advances the
+		// epoch past them so later readers do not hold them back, and
+		// passes those no reader can see any more to release
+		template<typename List, typename Object, typename Release> void retire(List& retired, Object* object, Release release) {
+			retired.emplace_back(epoch.load(), object);
+			if(retired.size() % retireBatch != 0) {
+				return;
+			}
+			uint64_t newest = retired.back().first;
+			if(epoch.load() == newest) {
+				epoch.compare_exchange_strong(newest, newest + 1);
+			}
+			uint64_t oldest = uint64_t(-1);
+			for(Reader* r = readers.load();r;r = r->next) {
+				uint64_t e = r->epoch.load();
+				if(e != 0 && e < oldest) {
+					oldest = e;
+				}
+			}
+			auto keep = retired.begin();
+			for(auto it = retired.begin();it != retired.end();++it) {
+				if(it->first < oldest) {
+					release(it->second);
+				}
+				else {
+					*keep++ = *it;
+				}
+			}
+			retired.erase(keep, retired.end());
+		}
+	};
+
+	struct EpochGuard {
+		EpochGuard() {
+			EpochDomain::instance().enter();
+		}
+		~EpochGuard() {
+			EpochDomain::instance().leave();
+		}
+	};
+
+	// Handler list of the Threaded emitter: emitting reads an immutable
+	// snapshot inside an epoch read section and takes no lock, writers copy
+	// the list under a mutex and publish the copy. Entries are shared
+	// between snapshots so a copy is one pointer per handler. Once handlers
+	// are claimed with an atomic flag, so concurrent emits run them once.
+	template<typename Handler>
+	class SnapshotHandlers {
+		struct Entry {
+			handle_id_type handle;
+			Handler handler;
+			int priority;
+			std::atomic<bool> fired;
+			template<typename F> Entry(handle_id_type _handle, F&& _handler, int _priority) : handle(_handle), handler(std::forward<F>(_handler)), priority(_priority), fired(false) {}
+		};
+		typedef Vector<std::shared_ptr<Entry>> Snapshot;
+		std::atomic<const Snapshot*> current;
+		std::atomic<size_t> live;
+		std::mutex writeMutex;
+		Vector<std::pair<uint64_t, const Snapshot*>> retired;
+		handle_id_type lastHandle = 0;
+#ifdef EVENTEMITTER_STATS
+		EmitStats emitStats;
+#endif
 
-#define __EVENTEMITTER_MUTEX_DECLARE(mutex) std::mutex mutex;
-#define __EVENTEMITTER_LOCK_GUARD(mutex) std::lock_guard<std::mutex> guard(mutex);
+		static void release(const Snapshot* snapshot) {
+			if(snapshot) {
+				freeObject(const_cast<Snapshot*>(snapshot));
+			}
+		}
+		void publish(const Snapshot* next) {
+			const Snapshot* old = current.exchange(next);
+			live.store(next ? next->size() : 0, std::memory_order_relaxed);
+			if(old) {
+				EpochDomain::instance().retire(retired, old, &release);
+			}
+		}
+	public:
+		SnapshotHandlers() : current(nullptr), live(0) {}
+		SnapshotHandlers(const SnapshotHandlers&) = delete;
+		SnapshotHandlers& operator=(const SnapshotHandlers&) = delete;
+		~SnapshotHandlers() {
+			release(current.load());
+			for(auto& old : retired) {
+				release(old.second);
+			}
+		}
+		// ordered like HandlerVector::add
+		template<typename F> handle_id_type add(F&& handler, bool once = false, int priority = 0) {
+			std::lock_guard<std::mutex> lock(writeMutex);
+			handle_id_type handle = ++lastHandle | (once ? onceHandleFlag : 0);
+			const Snapshot* old = current.load();
+			Snapshot* next = old ? allocateObject<Snapshot>(*old) : allocateObject<Snapshot>();
+			auto at = std::upper_bound(next->begin(), next->end(), priority, [](int priority, const std::shared_ptr<Entry>& entry) {
+				return priority > entry->priority;
+			});
+			next->insert(at, std::allocate_shared<Entry>(Allocator<Entry>(), handle, std::forward<F>(handler), priority));
+			publish(next);
+			return handle;
+		}
+		bool remove(handle_id_type handle) {
+			std::lock_guard<std::mutex> lock(writeMutex);
+			const Snapshot* old = current.load();
+			if(!old) {
+				return false;
+			}
+			auto it = std::find_if(old->begin(), old->end(), [handle](const std::shared_ptr<Entry>& entry) {
+				return entry->handle == handle;
+			});
+			if(it == old->end()) {
+				return false;
+			}
+			Snapshot* next = nullptr;
+			if(old->size() > 1) {
+				next = allocateObject<Snapshot>();
+				next->reserve(old->size() - 1);
+				next->insert(next->end(), old->begin(), it);
+				next->insert(next->end(), it + 1, old->end());
+			}
+			publish(next);
+			return true;
+		}
+		void clear() {
+			std::lock_guard<std::mutex> lock(writeMutex);
+			publish(nullptr);
+		}
+		size_t size() const {
+			return live.load(std::memory_order_relaxed);
+		}
+		bool empty() const {
+			return size() == 0;
+		}
+		StatsSnapshot stats() const {
+			StatsSnapshot snapshot;
+			snapshot.handlers = size();
+#ifdef EVENTEMITTER_STATS
+			emitStats.addTo(snapshot);
+#endif
+			return snapshot;
+		}
+		template<typename... Args> void emit(Args&&... fargs) {
+			EpochGuard guard;
+#ifdef EVENTEMITTER_STATS
+			EmitStats::Emit timing(emitStats);
+#endif
+			const Snapshot* snapshot = current.load();
+			if(snapshot) {
+				emitRange(*snapshot, 0, snapshot->size(), fargs...);
+			}
+		}
+		// splits the handlers among the caller and the pool, every handler
+		// gets the same arguments by reference
+		template<typename... Args> void parallelEmit(ThreadPool& pool, Args&... fargs) {
+			EpochGuard guard;
+#ifdef EVENTEMITTER_STATS
+			EmitStats::Emit timing(emitStats);
+#endif
+			const Snapshot* snapshot = current.load();
+			if(!snapshot) {
+				return;
+			}
+			size_t n = snapshot->size();
+			size_t chunks = std::min<size_t>(n / EVENTEMITTER_PARALLEL_GRAIN, pool.size() + 1);
+			if(chunks <= 1) {
+				emitRange(*snapshot, 0, n, fargs...);
+				return;
+			}
+			// the caller's read section keeps the snapshot alive for the workers
+			parallelFor(pool, chunks, [&](size_t chunk) {
+				emitRange(*snapshot, chunk * n / chunks, (chunk + 1) * n / chunks, fargs...);
+			});
+		}
+		// handler-major like HandlerVector::emitBatch, on one snapshot
+		template<typename Tuple> void emitBatch(const Tuple* events, size_t count) {
+			if(count == 0) {
+				return;
+			}
+			EpochGuard guard;
+#ifdef EVENTEMITTER_STATS
+			EmitStats::Emit timing(emitStats, count);
+#endif
+			const Snapshot* snapshot = current.load();
+			if(!snapshot) {
+				return;
+			}
+			for(const auto& ptr : *snapshot) {
+				Entry& entry = *ptr;
+				if(entry.handle & onceHandleFlag) {
+					if(!entry.fired.exchange(true)) {
+						remove(entry.handle);
+						applyTuple(entry.handler, events[0]);
+					}
+					continue;
+				}
+				for(size_t e = 0;e < count;++e) {
+#ifdef EVENTEMITTER_STATS
+					timing.handler([&] {
+						applyTuple(entry.handler, events[e]);
+					});
 #else
-#define __EVENTEMITTER_MUTEX_DECLARE(mutex);
-#define __EVENTEMITTER_LOCK_GUARD(mutex);
+					applyTuple(entry.handler, events[e]);
 #endif
-
-#if defined(__GNUC__)
-#define __EVENTEMITTER_GCC_WORKAROUND this->
+				}
+			}
+		}
+	private:
+		template<typename... Args> void emitRange(const Snapshot& snapshot, size_t from, size_t to, Args&... fargs) {
+			for(size_t i = from;i < to;++i) {
+				Entry& entry = *snapshot[i];
+				if(entry.handle & onceHandleFlag) {
+					if(entry.fired.exchange(true)) {
+						continue;
+					}
+					remove(entry.handle);
+				}
+#ifdef EVENTEMITTER_STATS
+				emitStats.handler([&] {
+					entry.handler(fargs...);
+				});
 #else
-#define __EVENTEMITTER_GCC_WORKAROUND
+				entry.handler(fargs...);
 #endif
+			}
+		}
+	};
 
-#define __EVENTEMITTER_CONCAT_IMPL(x, y) x ## y
-#define __EVENTEMITTER_CONCAT(x, y) __EVENTEMITTER_CONCAT_IMPL(x, y)
+	// EventTable for dispatchers used from several threads at once. Keys
+	// are spread over Shards by hash and each shard interns its own, under
+	// its own mutex, so adding names only contends within a shard. Looking
+	// up a name or an id takes no lock: the probe index of a shard is
+	// replaced when it grows and the old one freed once no reader can see
+	// it (see EpochDomain), and entries live in chunks that never move.
+	// An id holds the shard in its low bits. Keys are never removed.
+	template<typename Key, typename Value, size_t Shards = EVENTEMITTER_DISPATCHER_SHARDS>
+	class ShardedEventTable {
+		static_assert(Shards && (Shards & (Shards - 1)) == 0, "the number of shards must be a power of two");
+		struct Entry {
+			Key key;
+			Value value;
+			Entry(const Key& _key) : key(_key) {}
+		};
+		// hash in the high half, local id + 1 in the low half, zero when empty
+		struct Index {
+			size_t mask;
+			Vector<std::atomic<uint64_t>> buckets;
+			explicit Index(size_t size) : mask(size - 1), buckets(size) {}
+		};
+		// chunk c holds the entries from firstChunk * (2^c - 1) on
+		static const uint32_t firstChunk = 64;
+		typedef std::atomic<Entry*> EntryPtr;
+		struct Shard {
+			std::mutex writeMutex;
+			std::atomic<Index*> index{nullptr};
+			std::atomic<EntryPtr*> chunks[32] = {};
+			std::atomic<uint32_t> count{0};
+			Vector<std::pair<uint64_t, Index*>> retired;
+			char pad[64];
+		};
+		Shard shards[Shards];
 
-#ifndef __EVENTEMITTER_NONMACRO_DEFS
-#define __EVENTEMITTER_NONMACRO_DEFS
-namespace EE {
-	class DeferredBase {
-	protected: 
-		typedef std::function<void ()> DeferredHandler;
-		std::forward_list<DeferredHandler> removeHandlers;
-		std::forward_list<DeferredHandler> deferredQueue;
-		__EVENTEMITTER_MUTEX_DECLARE(mutex);
-	protected:
-		void runDeferred(DeferredHandler f) {
-			__EVENTEMITTER_LOCK_GUARD(mutex);
-			auto it = deferredQueue.cbegin();
-			auto prevIt = deferredQueue.cbefore_begin();
-			for(; it != deferredQueue.cend(); prevIt = it, ++it);
-			deferredQueue.emplace_after(prevIt, std::move(f));
+		static uint32_t hashOf(const Key& key) {
+			size_t hash = std::hash<Key>()(key);
+			return uint32_t(hash ^ (uint64_t(hash) >> 32));
 		}
-	public:
-		void removeAllHandlers() {
-			for(auto& handler : removeHandlers) {
-				handler();
+		static size_t chunkOf(uint32_t local, uint32_t& offset) {
+			size_t chunk = 0;
+			for(uint32_t n = local / firstChunk + 1;n > 1;n >>= 1) {
+				chunk++;
 			}
+			offset = local - firstChunk * ((uint32_t(1) << chunk) - 1);
+			return chunk;
 		}
-		void clearDeferred() {
-			__EVENTEMITTER_LOCK_GUARD(mutex);
-			deferredQueue.clear();
+		static EntryPtr* allocateChunk(size_t chunk) {
+			Allocator<EntryPtr> allocator;
+			EntryPtr* entries = std::allocator_traits<Allocator<EntryPtr>>::allocate(allocator, firstChunk << chunk);
+			for(size_t i = 0;i < (firstChunk << chunk);++i) {
+				new(&entries[i]) EntryPtr(nullptr);
+			}
+			return entries;
 		}
-		bool runDeferred() {
-			__EVENTEMITTER_LOCK_GUARD(mutex);
-			if(deferredQueue.empty()) {
-				return false;
+		static void freeChunk(EntryPtr* entries, size_t chunk) {
+			Allocator<EntryPtr> allocator;
+			std::allocator_traits<Allocator<EntryPtr>>::deallocate(allocator, entries, firstChunk << chunk);
+		}
+		static Entry& entry(const Shard& shard, uint32_t local) {
+			uint32_t offset;
+			size_t chunk = chunkOf(local, offset);
+			return *shard.chunks[chunk].load(std::memory_order_acquire)[offset].load(std::memory_order_acquire);
+		}
+		static uint32_t probe(const Shard& shard, const Index& index, uint32_t hash, const Key& key) {
+			for(size_t i = (hash / Shards) & index.mask;;i = (i + 1) & index.mask) {
+				uint64_t bucket = index.buckets[i].load(std::memory_order_acquire);
+				if(!bucket) {
+					return uint32_t(-1);
+				}
+				if(uint32_t(bucket >> 32) == hash && entry(shard, uint32_t(bucket) - 1).key == key) {
+					return uint32_t(bucket) - 1;
+				}
 			}
-			(deferredQueue.front())();
-			deferredQueue.pop_front();
-			return true;
 		}
-		void runAllDeferred() {
-			// TODO: make optimized runAll
-			while(runDeferred());
+		static void insert(Index& index, uint64_t bucket) {
+			size_t i = (size_t(bucket >> 32) / Shards) & index.mask;
+			while(index.buckets[i].load(std::memory_order_relaxed)) {
+				i = (i + 1) & index.mask;
+			}
+			index.buckets[i].store(bucket, std::memory_order_release);
+		}
+		// with the shard's mutex held
+		static void grow(Shard& shard) {
+			Index* old = shard.index.load(std::memory_order_relaxed);
+			Index* next = allocateObject<Index>(old ? (old->mask + 1) * 2 : 16);
+			if(old) {
+				for(size_t i = 0;i <= old->mask;++i) {
+					if(uint64_t bucket = old->buckets[i].load(std::memory_order_relaxed)) {
+						insert(*next, bucket);
+					}
+				}
+			}
+			shard.index.store(next, std::memory_order_release);
+			if(old) {
+				EpochDomain::instance().retire(shard.retired, old, [](Index* index) {
+					freeObject(index);
+				});
+			}
 		}
-	};
-	
-	// reference_wrapper needs to be used instead of std::reference_wrapper
-	// this is because of VS2013 (RC) bug
-	template<class T> class reference_wrapper
-	{
 	public:
-		typedef T type;
-		explicit reference_wrapper(T& t): t_(&t) {}
-		operator T& () const { return *t_; }
-		T& get() const { return *t_; }
-		T* get_pointer() const { return t_; }
-private:
-    T* t_;
-};
-	
-
-// source: stackoverflow.com/questions/15501301/binding-function-arguments-in-c11
-template<typename T> struct forward_as_ref_type {
- typedef T &&type;
-};
-template<typename T> struct forward_as_ref_type<T &> {
-	typedef reference_wrapper<T> type;
-};
-template<typename T> typename forward_as_ref_type<T>::type forward_as_ref(
- typename std::remove_reference<T>::type &t) {
-    return static_cast<typename forward_as_ref_type<T>::type>(t);
- }
- template<typename T> T &&forward_as_ref(
- typename std::remove_reference<T>::type &&t) {
-    return t;
- }
-
-template<typename... Args>	
-inline decltype(auto) wrapLambdaWithCallback(const std::function<void(Args...)>& f, std::function<void()>&& afterCb) {
-	return [=,afterCb=std::move(afterCb)](Args&&... args) {
-		f(args...);
-		afterCb();
+		ShardedEventTable() {}
+		ShardedEventTable(const ShardedEventTable&) = delete;
+		~ShardedEventTable() {
+			for(Shard& shard : shards) {
+				uint32_t count = shard.count.load();
+				for(uint32_t local = 0;local < count;++local) {
+					freeObject(&entry(shard, local));
+				}
+				for(size_t chunk = 0;chunk < 32;++chunk) {
+					if(EntryPtr* entries = shard.chunks[chunk].load()) {
+						freeChunk(entries, chunk);
+					}
+				}
+				if(Index* index = shard.index.load()) {
+					freeObject(index);
+				}
+				for(auto& old : shard.retired) {
+					freeObject(old.second);
+				}
+			}
+		}
+		EventId find(const Key& key) const {
+			uint32_t hash = hashOf(key);
+			const Shard& shard = shards[hash & (Shards - 1)];
+			EpochGuard guard;
+			const Index* index = shard.index.load(std::memory_order_acquire);
+			if(!index) {
+				return noEventId;
+			}
+			uint32_t local = probe(shard, *index, hash, key);
+			return local != uint32_t(-1) ? EventId(local * Shards + (hash & (Shards - 1))) : noEventId;
+		}
+		EventId intern(const Key& key) {
+			EventId id = find(key);
+			if(id != noEventId) {
+				return id;
+			}
+			uint32_t hash = hashOf(key);
+			Shard& shard = shards[hash & (Shards - 1)];
+			std::lock_guard<std::mutex> lock(shard.writeMutex);
+			// another thread may have added it since
+			Index* index = shard.index.load(std::memory_order_relaxed);
+			uint32_t local = index ? probe(shard, *index, hash, key) : uint32_t(-1);
+			if(local == uint32_t(-1)) {
+				local = shard.count.load(std::memory_order_relaxed);
+				// keep the load factor at or below 3/4
+				if(!index || (local + 1) * 4 > (index->mask + 1) * 3) {
+					grow(shard);
+					index = shard.index.load(std::memory_order_relaxed);
+				}
+				uint32_t offset;
+				size_t chunk = chunkOf(local, offset);
+				EntryPtr* entries = shard.chunks[chunk].load(std::memory_order_relaxed);
+				if(!entries) {
+					entries = allocateChunk(chunk);
+					shard.chunks[chunk].store(entries, std::memory_order_release);
+				}
+				entries[offset].store(allocateObject<Entry>(key), std::memory_order_release);
+				shard.count.store(local + 1, std::memory_order_relaxed);
+				insert(*index, uint64_t(hash) << 32 | (local + 1));
+			}
+			return EventId(local * Shards + (hash & (Shards - 1)));
+		}
+		Value& operator[](EventId id) {
+			return entry(shards[id & (Shards - 1)], uint32_t(id / Shards)).value;
+		}
+		size_t size() const {
+			size_t total = 0;
+			for(const Shard& shard : shards) {
+				total += shard.count.load(std::memory_order_relaxed);
+			}
+			return total;
+		}
 	};
-}
-
-template<typename... Args>	
-inline decltype(auto) wrapLambdaWithCallback(std::function<void(Args...)>&& f, std::function<void()>&& afterCb) {
-	return [f=std::move(f),afterCb=std::move(afterCb)](Args&&... args) {
-		f(args...);
-		afterCb();
+	template<typename Emitter, typename Key, typename Container> struct DispatcherEvents<Emitter, Key, Container, typename std::conditional<true, void, typename Emitter::ConcurrentHandlers>::type> {
+		typedef ShardedEventTable<Key, typename Emitter::ConcurrentHandlers> type;
 	};
-}
 
-#ifndef EVENTEMITTER_DISABLE_THREADING
-	
 	// TODO: allow callback for setting if async has completed
 	template<typename... Args>
 	class LambdaAsyncWrapper
 	{
-		std::function<void(Args...)> m_f;		
+		std::shared_ptr<const InplaceFunction<void(Args...)>> m_f;
 	public:
-		LambdaAsyncWrapper(const std::function<void(Args...)>& f) : m_f(f) {}
-		void operator()(Args... fargs) const { 
-			std::async(std::launch::async, m_f, fargs...);
+		// takes the handler over, so move-only handlers are never copied
+		LambdaAsyncWrapper(InplaceFunction<void(Args...)>&& f) : m_f(std::allocate_shared<const InplaceFunction<void(Args...)>>(Allocator<InplaceFunction<void(Args...)>>(), std::move(f))) {}
+		// the arguments are copied, the handler runs after the emit returns
+		void operator()(HandlerArg<Args>... fargs) const {
+			defaultThreadPool().post([f = m_f, args = std::tuple<std::decay_t<Args>...>(fargs...)]() mutable {
+				applyTuple(*f, args);
+			});
 		}
 	};
 	template<typename... Args>
-	LambdaAsyncWrapper<Args...> wrapLambdaInAsync(const std::function<void(Args...)>& f) {
-		return LambdaAsyncWrapper<Args...>(f);
+	LambdaAsyncWrapper<Args...> wrapLambdaInAsync(InplaceFunction<void(Args...)>&& f) {
+		return LambdaAsyncWrapper<Args...>(std::move(f));
 	};
 	
 	template<typename... Args>
@@ -162,83 +3501,56 @@ inline decltype(auto) wrapLambdaWithCallback(std::function<void(Args...)>&& f, s
 
 
 #ifndef __EVENTEMITTER_CONTAINER
-#define __EVENTEMITTER_CONTAINER std::forward_list<HandlerPtr>
+#define __EVENTEMITTER_CONTAINER EE::HandlerVector<Handler>
 #endif
 
-using handle_id_type = uint32_t;
-static handle_id_type __handle_counter;
-
 #define __EVENTEMITTER_PROVIDER(frontname, name) //^//
 template<typename... Rest>
 class ExampleEventEmitterTpl {
 public:
-	typedef std::function<void(Rest...)> Handler;
+	typedef EE::InplaceFunction<void(Rest...)> Handler;
 	using Handle = handle_id_type;
-	using HandlerTuple = std::tuple<Handle, Handler>;
-	struct HandlerPtr : public HandlerTuple {
-		HandlerPtr(Handler handler, bool _specialFlag = false) : HandlerTuple((__handle_counter++) | _specialFlag << 31 , std::move(handler)) {
-			if(__handle_counter & 0x80000000) {
-				__handle_counter = 0;
-			}
-		}
-		bool specialFlag() {
-			return std::get<0>(*this) & 0x80000000;
-		}
-		bool operator==(Handle other) {
-			return std::get<0>(*this) == other;
-		}
-		template<typename... Args> inline decltype(auto) operator() (Args&&... fargs) {
-			return std::get<1>(*this)(fargs...);
-		}
-		operator Handle() const { return std::get<0>(*this); }
-	};
 
 private:
 	using EventHandlersSet = __EVENTEMITTER_CONTAINER;
 	EventHandlersSet eventHandlers;
 public:
-	Handle onExample (Handler handler) {
-		eventHandlers.emplace_front(std::move(handler));
-		return eventHandlers.front();
+	// the handler is constructed in place, F is anything a Handler accepts;
+	// higher priorities run first, equal ones in the order they were added
+	template<typename F> Handle onExample (F&& handler, int priority = 0) {
+		return eventHandlers.add(std::forward<F>(handler), false, priority);
 	}
-	Handle onceExample (Handler handler) {
-		eventHandlers.emplace_front(std::move(handler), true);
-		return eventHandlers.front();
+	template<typename F> Handle onceExample (F&& handler, int priority = 0) {
+		return eventHandlers.add(std::forward<F>(handler), true, priority);
 	}
 	bool hasExampleHandlers() {
 		return !eventHandlers.empty();
 	}
 	int countExampleHandlers() {
-		int count = 0;
-		for(auto& i:eventHandlers) count++;
-		return count;
+		return eventHandlers.size();
 	}
 	template<typename... Args> inline void emitExample (Args&&... fargs) {
-		triggerExample(fargs...);
+		triggerExample(std::forward<Args>(fargs)...);
 	}
-	template<typename... Args> inline void triggerExample (Args&&... fargs) {
-		auto prev = eventHandlers.before_begin(); 
-	  for(auto i = eventHandlers.begin();i != eventHandlers.end();) {
-			
-			(*i)(fargs...);
-			if(i->specialFlag()) {
-				i = eventHandlers.erase_after(prev);
-			}
-			else {
-				++i;
-				++prev;
-			}
-		}
+	// arguments are converted once and the same objects go to every handler
+	void triggerExample (EE::HandlerArg<Rest>... fargs) {
+		eventHandlers.emit(fargs...);
+	}
+	// runs each handler over the whole batch of argument tuples before the
+	// next handler, so its code and captures stay in cache
+	template<typename Tuple> void triggerExampleBatch (const Tuple* events, size_t count) {
+		eventHandlers.emitBatch(events, count);
+	}
+	// any contiguous container of tuples, such as std::vector or std::array
+	template<typename Range> void triggerExampleBatch (const Range& events) {
+		triggerExampleBatch(events.data(), events.size());
 	}
 	bool removeExampleHandler (Handle handlerPtr) {
-		auto prev = eventHandlers.before_begin(); 
-		for(auto i = eventHandlers.begin();i != eventHandlers.end();++i,++prev) { 
-			if(*i == handlerPtr) {
-				eventHandlers.erase_after(prev);
-				return true;
-			}
-		}
- 		return false;
+		return eventHandlers.remove(handlerPtr);
+	}
+	// counters and latencies when built with EVENTEMITTER_STATS
+	EE::StatsSnapshot statsExample () const {
+		return eventHandlers.stats();
 	}
 	void removeAllExampleHandlers () {
 		eventHandlers.clear();
@@ -248,126 +3560,388 @@ public:
 #define __EVENTEMITTER_PROVIDER_DEFERRED(frontname, name) //^//
 template<typename... Rest>
 class ExampleDeferredEventEmitterTpl : public ExampleEventEmitterTpl<Rest...>, public virtual EE::DeferredBase {
+	typedef std::tuple<std::decay_t<Rest>...> DeferredArgs;
+	static void runDeferredArgs(void* self, DeferredArgs& args) {
+		EE::applyTuple([self](auto&... as) {
+			static_cast<ExampleDeferredEventEmitterTpl*>(self)->runExample(as...);
+		}, args);
+	}
+	EE::DeferredChannel<DeferredArgs> deferredEvents{this, &runDeferredArgs};
+	// awaiting coroutines, fired when an event runs
+	EE::WaiterList<Rest...> waiters;
+
+	template<typename... Args> void runExample (Args&... fargs) {
+		ExampleEventEmitterTpl<Rest...>::triggerExample(fargs...);
+		waiters.fire(fargs...);
+	}
 public:
+	typedef void DeferredTrigger;
+
 	ExampleDeferredEventEmitterTpl() {
-		DeferredBase::removeHandlers.emplace_front([=] {
+		DeferredBase::removeHandlers.emplace_front([this] {
 			this->removeAllExampleHandlers();
 		});
 	}
 
+	// handlers may be changed from any thread, the change waits until a
+	// drain running on another thread is done
+	template<typename F> handle_id_type onExample (F&& handler, int priority = 0) {
+		return betweenDrains([&] {
+			return ExampleEventEmitterTpl<Rest...>::onExample(std::forward<F>(handler), priority);
+		});
+	}
+	template<typename F> handle_id_type onceExample (F&& handler, int priority = 0) {
+		return betweenDrains([&] {
+			return ExampleEventEmitterTpl<Rest...>::onceExample(std::forward<F>(handler), priority);
+		});
+	}
+	bool removeExampleHandler (handle_id_type handle) {
+		return betweenDrains([&] {
+			return ExampleEventEmitterTpl<Rest...>::removeExampleHandler(handle);
+		});
+	}
+	void removeAllExampleHandlers () {
+		betweenDrains([&] {
+			ExampleEventEmitterTpl<Rest...>::removeAllExampleHandlers();
+		});
+	}
 	template<typename... Args> inline void emitExample (Args&&... fargs) {
-		triggerExample(fargs...);
+		triggerExample(std::forward<Args>(fargs)...);
 	}
+	// lvalue arguments are kept by reference until the event runs
 	template<typename... Args> void triggerExampleByRef (Args&&... fargs) {
-		runDeferred(
-			std::bind([=](Args... as) {
-			__EVENTEMITTER_GCC_WORKAROUND ExampleEventEmitterTpl<Rest...>::triggerExample(as...);
-			}, EE::forward_as_ref<Args>(fargs)...));
-	}
-	template<typename... Args> void triggerExample (Args... fargs) {
-		runDeferred(
-			std::bind([=](Args... as) {
-			__EVENTEMITTER_GCC_WORKAROUND ExampleEventEmitterTpl<Rest...>::triggerExample(as...);
-			}, fargs...));
-	}	
+		deferExampleArgs(std::tuple<std::decay_t<typename EE::forward_as_ref_type<Args>::type>...>(EE::forward_as_ref<Args>(fargs)...));
+	}
+	// arguments are moved (or copied from lvalues) once into the queued event
+	template<typename... Args> void triggerExample (Args&&... fargs) {
+		pushDeferred(deferredEvents, std::forward<Args>(fargs)...);
+	}
+	// false when a bounded queue is full and the event was dropped
+	template<typename... Args> bool tryTriggerExample (Args&&... fargs) {
+		return tryPushDeferred(deferredEvents, std::forward<Args>(fargs)...);
+	}
+	// while on, a trigger replaces the pending event of this emitter
+	void setExampleCoalescing (bool on = true) {
+		setCoalescing(deferredEvents, on);
+	}
+	// handler stats plus queue depth and how long events waited
+	EE::StatsSnapshot statsExample () const {
+		EE::StatsSnapshot snapshot = ExampleEventEmitterTpl<Rest...>::statsExample();
+		deferredStats(deferredEvents, snapshot);
+		return snapshot;
+	}
+	// queues a copy of the batch as one event, which runs handler-major
+	template<typename Tuple> void triggerExampleBatch (const Tuple* events, size_t count) {
+		if(count == 0) {
+			return;
+		}
+		runDeferred(this, [this, batch = EE::Vector<Tuple>(events, events + count)]() {
+			__EVENTEMITTER_GCC_WORKAROUND ExampleEventEmitterTpl<Rest...>::triggerExampleBatch(batch.data(), batch.size());
+			EE::applyTuple([this](auto&... as) {
+				__EVENTEMITTER_GCC_WORKAROUND waiters.fire(as...);
+			}, batch.front());
+		});
+	}
+	template<typename Range> void triggerExampleBatch (const Range& events) {
+		triggerExampleBatch(events.data(), events.size());
+	}
+	// co_await nextExample() suspends the coroutine until the next event
+	// runs and yields its arguments as a tuple; the executor resumes it,
+	// on the thread running the event by default
+	template<typename Executor = EE::InlineResume> auto nextExample (Executor executor = Executor()) {
+		return EE::NextEvent<Executor, Rest...>(waiters, std::move(executor));
+	}
+	// co_await stream.next() on the result takes every event that runs
+	// from now on in order, see EE::EventStream
+	template<typename Executor = EE::InlineResume> auto streamExample (Executor executor = Executor()) {
+		return EE::EventStream<Executor, Rest...>(std::move(executor), [this](auto state) {
+			handle_id_type handle = this->onExample([state](EE::HandlerArg<Rest>... fargs) {
+				state->push(fargs...);
+			});
+			return EE::InplaceFunction<void()>([this, handle] {
+				this->removeExampleHandler(handle);
+			});
+		});
+	}
+private:
+	template<typename Tuple> void deferExampleArgs (Tuple&& args) {
+		runDeferred(this, [this, args = std::move(args)]() mutable {
+			EE::applyTuple([this](auto&... as) {
+				__EVENTEMITTER_GCC_WORKAROUND runExample(as...);
+			}, args);
+		});
+	}
 }; //_//
 
 #ifndef EVENTEMITTER_DISABLE_THREADING
 
 #define __EVENTEMITTER_PROVIDER_THREADED(frontname, name) //^//
 template<typename... Rest>
-class ExampleThreadedEventEmitterTpl : public ExampleEventEmitterTpl<Rest...>, public virtual EE::DeferredBase { 
-  std::condition_variable condition;
-	std::mutex m;
+class ExampleThreadedEventEmitterTpl : public virtual EE::DeferredBase { 
+public:
+	typedef EE::InplaceFunction<void(Rest...)> Handler;
+	using Handle = handle_id_type;
+	// a dispatcher over this emitter keeps these per name in a sharded table
+	typedef EE::SnapshotHandlers<Handler> ConcurrentHandlers;
+private:
+	typedef std::tuple<Rest...> FutureArgs;
+	typedef std::tuple<std::decay_t<Rest>...> DeferredArgs;
+
+	typedef typename EE::WaiterList<Rest...>::Waiter Waiter;
+	// lives on the stack of a thread in waitX
+	struct HandlerWaiter : Waiter {
+		Handler* handler;
+		EE::WaitSlot* slot;
+	};
+	// pooled, the promise's shared state is the only allocation of a future
+	struct FutureWaiter : Waiter {
+		std::promise<FutureArgs> promise{std::allocator_arg, EE::Allocator<char>()};
+	};
+	// the waiting thread is woken even when the handler throws
+	static bool fireHandler(Waiter* waiter, EE::HandlerArg<Rest>... fargs) {
+		HandlerWaiter* self = static_cast<HandlerWaiter*>(waiter);
+		struct Wake {
+			EE::WaitSlot* slot;
+			~Wake() {
+				slot->wake();
+			}
+		} wake{self->slot};
+		(*self->handler)(fargs...);
+		return false;
+	}
+	static bool fireFuture(Waiter* waiter, EE::HandlerArg<Rest>... fargs) {
+		static_cast<FutureWaiter*>(waiter)->promise.set_value(FutureArgs(fargs...));
+		return true;
+	}
+	// pending futures get std::future_errc::broken_promise
+	static void releaseFuture(Waiter* waiter) {
+		EE::freeObject(static_cast<FutureWaiter*>(waiter));
+	}
+	// queued by asyncWaitX; it holds a reference until it is set up and
+	// the wait holds one until a trigger, the timeout or the emitter ends it
+	struct AsyncWaiter : Waiter {
+		Handler handler;
+		std::function<void()> timeout;
+		std::atomic<uint64_t> timer{0};
+		std::atomic<bool> ended{false};
+		std::atomic<int> refs{2};
+		AsyncWaiter(Handler&& _handler, const std::function<void()>& _timeout) : handler(std::move(_handler)), timeout(_timeout) {}
+	};
+	static void unrefAsync(AsyncWaiter* self) {
+		if(self->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			EE::freeObject(self);
+		}
+	}
+	static void endAsync(AsyncWaiter* self) {
+		self->ended.store(true);
+		if(uint64_t timer = self->timer.load()) {
+			EE::defaultTimerQueue().cancel(timer);
+		}
+		unrefAsync(self);
+	}
+	static bool fireAsync(Waiter* waiter, EE::HandlerArg<Rest>... fargs) {
+		AsyncWaiter* self = static_cast<AsyncWaiter*>(waiter);
+		EE::defaultThreadPool().post([handler = std::move(self->handler), args = DeferredArgs(fargs...)]() mutable {
+			EE::applyTuple(handler, args);
+		});
+		endAsync(self);
+		return false;
+	}
+	// the emitter is going away, the handler never runs
+	static void releaseAsync(Waiter* waiter) {
+		endAsync(static_cast<AsyncWaiter*>(waiter));
+	}
+	EE::WaiterList<Rest...> waiters;
 
-	typedef typename ExampleEventEmitterTpl<Rest...>::Handler Handler;
-	typedef typename ExampleEventEmitterTpl<Rest...>::HandlerPtr HandlerPtr;
-	typedef typename ExampleEventEmitterTpl<Rest...>::Handle Handle;
+	static void runDeferredArgs(void* self, DeferredArgs& args) {
+		EE::applyTuple([self](auto&... as) {
+			static_cast<ExampleThreadedEventEmitterTpl*>(self)->triggerExample(as...);
+		}, args);
+	}
+	EE::DeferredChannel<DeferredArgs> deferredEvents{this, &runDeferredArgs, true};
+	// not the handler store of EventEmitterTpl, which this is not derived
+	// from: see EE::SnapshotHandlers
+	EE::SnapshotHandlers<Handler> handlers;
+
+	void emitHandlers (EE::HandlerArg<Rest>... fargs) {
+		handlers.emit(fargs...);
+	}
+	void parallelEmitHandlers (EE::HandlerArg<Rest>... fargs) {
+		handlers.parallelEmit(EE::defaultThreadPool(), fargs...);
+	}
 	
 public:
 	ExampleThreadedEventEmitterTpl() {
-	}	
+	}
 	bool waitExample (std::chrono::milliseconds duration = std::chrono::milliseconds::max()) {
-		waitExample([=](Rest...) {
+		return waitExample([](EE::HandlerArg<Rest>...) {
 		}, duration);
- 	}
- 	bool waitExample (Handler handler, std::chrono::milliseconds duration = std::chrono::milliseconds::max()) {
-		std::shared_ptr<std::atomic<bool>> finished = std::make_shared<std::atomic<bool>>();
-		std::unique_lock<std::mutex> lk(m);
-		Handle ptr = onceExample(
-			EE::wrapLambdaWithCallback(handler, [=]() {
-				finished->store(true);
-				this->condition.notify_all();
-		}));
-		
-		if(duration == std::chrono::milliseconds::max()) {
-			condition.wait(lk);
-		} 
-		else {
-			condition.wait_for(lk, duration, [=]() {
-				return finished->load();
-			});
+	}
+	// handler runs on the triggering thread, after the handlers, and
+	// before this returns true; false when the duration passed first
+	bool waitExample (Handler handler, std::chrono::milliseconds duration = std::chrono::milliseconds::max()) {
+		HandlerWaiter waiter;
+		waiter.fire = &fireHandler;
+		waiter.handler = &handler;
+		waiter.slot = &EE::WaitSlot::local();
+		waiter.slot->reset();
+		waiters.push(&waiter);
+		if(waiter.slot->waitFor(duration)) {
+			return true;
 		}
-		bool gotFinished = finished->load();
-		if(!gotFinished) {
-			ExampleEventEmitterTpl<Rest...>::removeExampleHandler(ptr);
+		if(waiters.remove(&waiter)) {
+			return false;
 		}
-		return gotFinished;
- 	}
+		// a trigger took it in the meantime and runs the handler
+		waiter.slot->waitFor(std::chrono::milliseconds::max());
+		return true;
+	}
+	// handler runs on the shared pool after the next trigger, asyncTimeout
+	// there once the duration passed first; no thread waits meanwhile
 	void asyncWaitExample(Handler handler, std::chrono::milliseconds duration, const std::function<void()>& asyncTimeout) {
-		auto async = std::async(std::launch::async, [=]() {
-			if(!waitExample(handler, duration))
-				asyncTimeout();
-		});
+		AsyncWaiter* waiter = EE::allocateObject<AsyncWaiter>(std::move(handler), asyncTimeout);
+		waiter->fire = &fireAsync;
+		waiter->release = &releaseAsync;
+		waiters.push(waiter);
+		if(duration != std::chrono::milliseconds::max()) {
+			uint64_t timer = EE::defaultTimerQueue().schedule(duration, [this, waiter] {
+				if(waiters.remove(waiter)) {
+					if(waiter->timeout) {
+						EE::defaultThreadPool().post(std::move(waiter->timeout));
+					}
+					unrefAsync(waiter);
+				}
+			});
+			waiter->timer.store(timer);
+			// a trigger that came first could not cancel the timer
+			if(waiter->ended.load()) {
+				EE::defaultTimerQueue().cancel(timer);
+			}
+		}
+		unrefAsync(waiter);
 	}
 	
-	Handle onExample (Handler handler) {
-		__EVENTEMITTER_LOCK_GUARD(mutex);
-		return ExampleEventEmitterTpl<Rest...>::onExample(handler);
+	Handle onExample (Handler handler, int priority = 0) {
+		return handlers.add(std::move(handler), false, priority);
+	}
+	Handle onceExample (Handler&& handler, int priority = 0) {
+		return handlers.add(std::move(handler), true, priority);
+	}
+	bool hasExampleHandlers() {
+		return !handlers.empty();
+	}
+	int countExampleHandlers() {
+		return handlers.size();
 	}
-	Handle onceExample (Handler&& handler) {
-		__EVENTEMITTER_LOCK_GUARD(mutex);
-		return ExampleEventEmitterTpl<Rest...>::onceExample(handler);
+	bool removeExampleHandler (Handle handle) {
+		return handlers.remove(handle);
+	}
+	void removeAllExampleHandlers () {
+		handlers.clear();
 	}
 	Handle asyncOnExample (Handler handler) {
-		return onExample(EE::wrapLambdaInAsync(handler));
+		return onExample(EE::wrapLambdaInAsync(std::move(handler)));
 	}
 	Handle asyncOnceExample (Handler handler) {
-		return onceExample(EE::wrapLambdaInAsync(handler));
+		return onceExample(EE::wrapLambdaInAsync(std::move(handler)));
 	}
+	// the future gets the arguments of the next trigger
 	auto futureOnceExample() -> decltype(std::future<std::tuple<Rest...>>()) {
-		typedef std::tuple<Rest...> TupleEventType;
-		auto promise = std::make_shared<std::promise<TupleEventType>>();
-		auto future = promise->get_future();
-		condition.notify_all();
-		onceExample(EE::getLambdaForFuture(promise));
+		FutureWaiter* waiter = static_cast<FutureWaiter*>(waiters.reuse());
+		if(waiter) {
+			waiter->promise = std::promise<FutureArgs>(std::allocator_arg, EE::Allocator<char>());
+		}
+		else {
+			waiter = EE::allocateObject<FutureWaiter>();
+			waiter->fire = &fireFuture;
+			waiter->release = &releaseFuture;
+		}
+		auto future = waiter->promise.get_future();
+		waiters.push(waiter);
 		return future;
 	}
+	// co_await nextExample() suspends the coroutine until the next trigger
+	// and yields its arguments as a tuple; the executor resumes it, on the
+	// triggering thread by default or e.g. with EE::PoolResume{&pool}
+	template<typename Executor = EE::InlineResume> auto nextExample (Executor executor = Executor()) {
+		return EE::NextEvent<Executor, Rest...>(waiters, std::move(executor));
+	}
+	// co_await stream.next() on the result takes every trigger from now on
+	// in order, see EE::EventStream
+	template<typename Executor = EE::InlineResume> auto streamExample (Executor executor = Executor()) {
+		return EE::EventStream<Executor, Rest...>(std::move(executor), [this](auto state) {
+			Handle handle = onExample([state](EE::HandlerArg<Rest>... fargs) {
+				state->push(fargs...);
+			});
+			return EE::InplaceFunction<void()>([this, handle] {
+				removeExampleHandler(handle);
+			});
+		});
+	}
 	template<typename... Args> inline void emitExample (Args&&... fargs) {
-		triggerExample(fargs...);
+		triggerExample(std::forward<Args>(fargs)...);
 	}
-	template<typename... Args> void triggerExample (Args&&... fargs) { 
-		__EVENTEMITTER_LOCK_GUARD(mutex);
-		ExampleEventEmitterTpl<Rest...>::triggerExample(fargs...);
-		condition.notify_all();
-	}
-	template<typename... Args> void deferExampleByRef (Args&&... fargs) { 
-		runDeferred(
- 			std::bind([=](Args... as) {
- 			__EVENTEMITTER_GCC_WORKAROUND ExampleEventEmitterTpl<Rest...>::triggerExample(as...);
- 			},
-			EE::forward_as_ref<Args>(fargs)...			
-			//fargs...
-			));
-	}
-	template<typename... Args> void deferExample (Args... fargs) { 
-		runDeferred(
- 			std::bind([=](Args... as) {
- 			__EVENTEMITTER_GCC_WORKAROUND ExampleEventEmitterTpl<Rest...>::triggerExample(as...);
- 			},
-			fargs...			
-			//fargs...
-			));
+	// no lock is held while handlers run, so they may use this emitter
+	template<typename... Args> void triggerExample (Args&&... fargs) {
+		emitHandlers(fargs...);
+		waiters.fire(fargs...);
+	}
+	// handler-major over the batch, waiters get the first event
+	template<typename Tuple> void triggerExampleBatch (const Tuple* events, size_t count) {
+		handlers.emitBatch(events, count);
+		if(count) {
+			EE::applyTuple([this](auto&... as) {
+				__EVENTEMITTER_GCC_WORKAROUND waiters.fire(as...);
+			}, *events);
+		}
+	}
+	template<typename Range> void triggerExampleBatch (const Range& events) {
+		triggerExampleBatch(events.data(), events.size());
+	}
+	// runs the handlers spread over the shared pool and returns when all
+	// are done, handlers run in no particular order
+	template<typename... Args> void parallelTriggerExample (Args&&... fargs) {
+		parallelEmitHandlers(fargs...);
+		waiters.fire(fargs...);
+	}
+	template<typename... Args> void deferExampleByRef (Args&&... fargs) {
+		deferExampleArgs(std::tuple<std::decay_t<typename EE::forward_as_ref_type<Args>::type>...>(EE::forward_as_ref<Args>(fargs)...));
+	}
+	template<typename... Args> void deferExample (Args&&... fargs) {
+		pushDeferred(deferredEvents, std::forward<Args>(fargs)...);
+	}
+	// false when a bounded queue is full and the event was dropped
+	template<typename... Args> bool tryDeferExample (Args&&... fargs) {
+		return tryPushDeferred(deferredEvents, std::forward<Args>(fargs)...);
+	}
+	// while on, a defer replaces the pending event of this emitter
+	void setExampleCoalescing (bool on = true) {
+		setCoalescing(deferredEvents, on);
+	}
+	EE::StatsSnapshot statsExample () const {
+		EE::StatsSnapshot snapshot = handlers.stats();
+		deferredStats(deferredEvents, snapshot);
+		return snapshot;
+	}
+	// queues a copy of the batch as one event, which runs handler-major
+	template<typename Tuple> void deferExampleBatch (const Tuple* events, size_t count) {
+		if(count == 0) {
+			return;
+		}
+		runDeferred(this, [this, batch = EE::Vector<Tuple>(events, events + count)]() {
+			__EVENTEMITTER_GCC_WORKAROUND triggerExampleBatch(batch.data(), batch.size());
+		});
+	}
+	template<typename Range> void deferExampleBatch (const Range& events) {
+		deferExampleBatch(events.data(), events.size());
+	}
+private:
+	template<typename Tuple> void deferExampleArgs (Tuple&& args) {
+		runDeferred(this, [this, args = std::move(args)]() mutable {
+			EE::applyTuple([this](auto&... as) {
+				__EVENTEMITTER_GCC_WORKAROUND triggerExample(as...);
+			}, args);
+		});
 	}
 }; //_//
 
@@ -377,64 +3951,142 @@ public:
 
  #define __EVENTEMITTER_DISPATCHER(frontname, name) //^//
 template<template<typename...> class EventDispatcherBase, typename T, typename... Rest>
-class ExampleEventDispatcherTpl : public EventDispatcherBase<T, Rest...> {
- 	using HandlerPtr =  typename EventDispatcherBase<Rest...>::HandlerPtr;
+class ExampleEventDispatcherTpl : public EventDispatcherBase<EE::EventKey, Rest...> {
+	using Base = EventDispatcherBase<EE::EventKey, Rest...>;
 	using Handler = typename EventDispatcherBase<Rest...>::Handler;
 	using Handle = typename EventDispatcherBase<Rest...>::Handle;
-	std::multimap<T, HandlerPtr> map;
-	bool eraseLast = false;
+	// each event name has its own handler store, so handlers can change
+	// the handlers of the event that is running them; over a threaded
+	// emitter names are sharded and their handlers are snapshots
+	typename EE::DispatcherEvents<EventDispatcherBase<Rest...>, T, __EVENTEMITTER_CONTAINER>::type events;
+
+	// a deferred dispatcher queues here and runs the handlers of the key
+	// directly, so runDeferredParallel can run different keys at once
+	typedef std::tuple<EE::EventKey, std::decay_t<Rest>...> KeyedArgs;
+	static void runKeyed(void* self, KeyedArgs& args) {
+		EE::applyTuple([self](EE::EventKey key, auto&... as) {
+			static_cast<ExampleEventDispatcherTpl*>(self)->events[key.id].emit(as...);
+		}, args);
+	}
+	EE::DeferredChannel<KeyedArgs> keyedEvents{this, &runKeyed};
+
+	template<typename... Args> bool triggerKey (std::false_type, bool, EE::EventKey key, Args&&... fargs) {
+		Base::triggerExample(key, std::forward<Args>(fargs)...);
+		return true;
+	}
+	void queueStats (std::false_type, EE::StatsSnapshot&) {
+	}
+	void queueStats (std::true_type, EE::StatsSnapshot& snapshot) {
+		this->deferredStats(keyedEvents, snapshot);
+	}
+	template<typename... Args> bool triggerKey (std::true_type, bool wait, EE::EventKey key, Args&&... fargs) {
+		return wait ? this->pushDeferred(keyedEvents, key, std::forward<Args>(fargs)...)
+			: this->tryPushDeferred(keyedEvents, key, std::forward<Args>(fargs)...);
+	}
+	EE::EventId triggeredId (std::false_type, const T& eventName) {
+		return events.find(eventName);
+	}
+	EE::EventId triggeredId (std::true_type, const T& eventName) {
+		return events.intern(eventName);
+	}
+	// a deferred dispatcher changes handlers between drains, see onExample
+	template<typename F> decltype(auto) changeHandlers (std::false_type, F&& f) {
+		return f();
+	}
+	template<typename F> decltype(auto) changeHandlers (std::true_type, F&& f) {
+		return this->betweenDrains(std::forward<F>(f));
+	}
 public:
 	ExampleEventDispatcherTpl() {
-		ExampleEventEmitter<T, Rest...>::onExample([&](T eventName, Rest... fargs) {
- 			auto ret = map.equal_range(eventName);
- 			for(auto it = ret.first;it != ret.second;) {
- 				(it->second)(fargs...);
-				if(eraseLast) {
-					it = map.erase(it);
-					eraseLast = false;
-				}
-				else {
-					++it;
-				}
- 			}
+		Base::onExample([&](EE::EventKey key, EE::HandlerArg<Rest>... fargs) {
+			events[key.id].emit(fargs...);
 		});
 	}
-	bool hasExampleHandlers(T eventName) {
-		return map.find(eventName) != map.end();
+	// the id of an event name, triggering and listening by id skips hashing
+	EE::EventId internExample(const T& eventName) {
+		return events.intern(eventName);
+	}
+	bool hasExampleHandlers(const T& eventName) {
+		EE::EventId id = events.find(eventName);
+		return id != EE::noEventId && !events[id].empty();
 	}
-	int countExampleHandlers(T eventName) {
-		int count = 0;
-		auto ret = map.equal_range(eventName);
-		for(auto it = ret.first;it != ret.second;++it)
-			count++;
-		return count;
+	int countExampleHandlers(const T& eventName) {
+		EE::EventId id = events.find(eventName);
+		return id != EE::noEventId ? events[id].size() : 0;
 	}
 	
- 	Handle onExample (T eventName, Handler handler) {
-		return map.insert(std::pair<T, Handler>(eventName,  handler))->second;
- 	}
- 	Handle onceExample (T eventName, Handler handler) {
-		return map.insert(std::pair<T, Handler>(eventName,  
-			EE::wrapLambdaWithCallback(handler, [&] {
-				eraseLast = true;
-			})))->second;
- 	}
- 	bool removeExampleHandler (T eventName, Handle handler) {
-		auto ret = map.equal_range(eventName);
-		for(auto it = ret.first;it != ret.second;++it) {
-			if(it->second == handler) {
-				it = map.erase(it);
-				return true;
-			}
-		}
-		return false;
+	// over a deferred emitter handlers may be changed from any thread, the
+	// change waits until a drain running on another thread is done
+	Handle onExample (const T& eventName, Handler handler, int priority = 0) {
+		return changeHandlers(EE::TriggerIsDeferred<Base>(), [&] {
+			return events[internExample(eventName)].add(std::move(handler), false, priority);
+		});
+	}
+	Handle onExampleById (EE::EventId id, Handler handler, int priority = 0) {
+		return changeHandlers(EE::TriggerIsDeferred<Base>(), [&] {
+			return events[id].add(std::move(handler), false, priority);
+		});
+	}
+	Handle onceExample (const T& eventName, Handler handler, int priority = 0) {
+		return changeHandlers(EE::TriggerIsDeferred<Base>(), [&] {
+			return events[internExample(eventName)].add(std::move(handler), true, priority);
+		});
+	}
+	Handle onceExampleById (EE::EventId id, Handler handler, int priority = 0) {
+		return changeHandlers(EE::TriggerIsDeferred<Base>(), [&] {
+			return events[id].add(std::move(handler), true, priority);
+		});
+	}
+	template<typename... Args> inline void emitExample (const T& eventName, Args&&... fargs) {
+		triggerExample(eventName, std::forward<Args>(fargs)...);
 	}
-	void removeAllExampleHandlers (T eventName) {
-		auto ret = map.equal_range(eventName);
-		for(auto it = ret.first;it != ret.second;) {		
-			it = map.erase(it);
+	// a deferred dispatcher interns the name so it can queue the id and
+	// handlers added before the event runs still see it; otherwise a name
+	// nobody listens to is not added to the table
+	template<typename... Args> void triggerExample (const T& eventName, Args&&... fargs) {
+		EE::EventId id = triggeredId(EE::TriggerIsDeferred<Base>(), eventName);
+		if(id != EE::noEventId) {
+			triggerExampleById(id, std::forward<Args>(fargs)...);
 		}
 	}
+	template<typename... Args> void triggerExampleById (EE::EventId id, Args&&... fargs) {
+		triggerKey(EE::TriggerIsDeferred<Base>(), true, EE::EventKey{id}, std::forward<Args>(fargs)...);
+	}
+	// false when a bounded deferred queue is full and the event was dropped
+	template<typename... Args> bool tryTriggerExample (const T& eventName, Args&&... fargs) {
+		EE::EventId id = triggeredId(EE::TriggerIsDeferred<Base>(), eventName);
+		return id == EE::noEventId || tryTriggerExampleById(id, std::forward<Args>(fargs)...);
+	}
+	template<typename... Args> bool tryTriggerExampleById (EE::EventId id, Args&&... fargs) {
+		return triggerKey(EE::TriggerIsDeferred<Base>(), false, EE::EventKey{id}, std::forward<Args>(fargs)...);
+	}
+	// stats of the handlers of one name; a deferred dispatcher adds the
+	// queue depth and how long events of all names waited
+	EE::StatsSnapshot statsExample (const T& eventName) {
+		EE::EventId id = events.find(eventName);
+		EE::StatsSnapshot snapshot = id != EE::noEventId ? events[id].stats() : EE::StatsSnapshot();
+		queueStats(EE::TriggerIsDeferred<Base>(), snapshot);
+		return snapshot;
+	}
+	// deferred dispatchers only: while on, a trigger replaces the pending
+	// event of the same name
+	void setExampleCoalescing (bool on = true) {
+		this->setCoalescing(keyedEvents, on);
+	}
+	bool removeExampleHandler (const T& eventName, Handle handler) {
+		return changeHandlers(EE::TriggerIsDeferred<Base>(), [&] {
+			EE::EventId id = events.find(eventName);
+			return id != EE::noEventId && events[id].remove(handler);
+		});
+	}
+	void removeAllExampleHandlers (const T& eventName) {
+		changeHandlers(EE::TriggerIsDeferred<Base>(), [&] {
+			EE::EventId id = events.find(eventName);
+			if(id != EE::noEventId) {
+				events[id].clear();
+			}
+		});
+	}
  }; //_//
 
 
@@ -458,7 +4110,7 @@ __EVENTEMITTER_PROVIDER(name,name) \
 __EVENTEMITTER_PROVIDER_THREADED(name,name) \
 typedef __EVENTEMITTER_CONCAT(name, ThreadedEventEmitterTpl)<__VA_ARGS__> className;
 
-#define DefineThreadedEventEmitter(name, ...) __EVENTEMITTER_CONCAT(name, ThreadedEventEmitter), __VA_ARGS__)
+#define DefineThreadedEventEmitter(name, ...) DefineThreadedEventEmitterAs(name, __EVENTEMITTER_CONCAT(name, ThreadedEventEmitter), __VA_ARGS__)
 
 __EVENTEMITTER_PROVIDER(/**/,/**/)
 template<typename... Rest> class EventEmitter : public EventEmitterTpl<Rest...> {};
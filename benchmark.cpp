@@ -1,13 +1,377 @@
 #include "EventEmitter.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
 
 DefineDeferredEventEmitter(Test)
+DefineEventEmitter(Tick, int)
+__EVENTEMITTER_PROVIDER_DEFERRED(Tick, Tick)
+__EVENTEMITTER_PROVIDER_THREADED(Tick, Tick)
+__EVENTEMITTER_DISPATCHER(Tick, Tick)
+typedef TickDeferredEventEmitterTpl<int> TickDeferredEventEmitter;
+DefineThreadedEventEmitter(Quote, int)
+DefineThreadedEventEmitter(Stamp, long long)
 
-int main(void)
+// every allocation of the process, the library's included; GCC takes the
+// free below for a mismatch once the replaced delete is inlined
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+static std::atomic<long long> allocations(0);
+
+void* operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if(void* p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+// handlers add to sums that end up here, so their work is not optimized out
+static volatile long long sink = 0;
+
+static bool jsonOutput = false;
+static const char* filter = nullptr;
+
+static long long nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string param(const char* name, long long value)
+{
+	return name + ("=" + std::to_string(value));
+}
+
+static bool wanted(const std::string& name)
+{
+	return !filter || name.find(filter) != std::string::npos;
+}
+
+// nearest rank of sorted samples; a sample is the mean ns/op of one batch,
+// so these are percentiles of batch means, not of single operations
+static double percentile(const std::vector<double>& sorted, double q)
+{
+	size_t rank = size_t(std::ceil(q * sorted.size()));
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void report(const std::string& name, const std::string& parameter, long long ops, long long elapsed, long long allocated, std::vector<double>& samples)
+{
+	std::sort(samples.begin(), samples.end());
+	double ns = double(elapsed) / ops;
+	double allocs = double(allocated) / ops;
+	if(jsonOutput) {
+		printf("{\"benchmark\": \"%s\", \"param\": \"%s\", \"ops\": %lld, \"samples\": %zu, \"ns_per_op\": %.2f, "
+			"\"sample_p50_ns\": %.2f, \"sample_p90_ns\": %.2f, \"sample_p99_ns\": %.2f, \"sample_max_ns\": %.2f, \"allocs_per_op\": %.4f}\n",
+			name.c_str(), parameter.c_str(), ops, samples.size(), ns,
+			percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99), samples.back(), allocs);
+	}
+	else {
+		printf("%-24s %-20s %10.1f %10.1f %10.1f %10.1f %10.1f %10.3f\n", name.c_str(), parameter.c_str(), ns,
+			percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99), samples.back(), allocs);
+	}
+	fflush(stdout);
+}
+
+// runs body(batch) once per sample; ns/op and allocations/op are over all
+// samples, the percentiles are of the per-sample ns/op
+template<typename Body> static void measure(const std::string& name, const std::string& parameter, long long batch, int samples, Body&& body)
+{
+	if(!wanted(name)) {
+		return;
+	}
+	std::vector<double> ns;
+	ns.reserve(samples);
+	long long elapsed = 0;
+	long long allocated = allocations.load();
+	for(int i = 0;i < samples;++i) {
+		long long start = nowNs();
+		body(batch);
+		long long sample = nowNs() - start;
+		elapsed += sample;
+		ns.push_back(double(sample) / batch);
+	}
+	allocated = allocations.load() - allocated;
+	report(name, parameter, batch * samples, elapsed, allocated, ns);
+}
+
+// like measure, for bodies that leave setup out or time a single operation
+// across threads: body(batch) returns the nanoseconds it measured
+template<typename Body> static void measureTimed(const std::string& name, const std::string& parameter, long long batch, int samples, Body&& body)
+{
+	if(!wanted(name)) {
+		return;
+	}
+	std::vector<double> ns;
+	ns.reserve(samples);
+	long long elapsed = 0;
+	long long allocated = allocations.load();
+	for(int i = 0;i < samples;++i) {
+		long long sample = body(batch);
+		elapsed += sample;
+		ns.push_back(double(sample) / batch);
+	}
+	allocated = allocations.load() - allocated;
+	report(name, parameter, batch * samples, elapsed, allocated, ns);
+}
+
+// immediate, deferred and threaded emit by handler count
+static void emitScaling()
+{
+	for(int handlers = 1;handlers <= 1000;handlers *= 10) {
+		TickEventEmitter immediate;
+		TickDeferredEventEmitter deferred;
+		QuoteThreadedEventEmitter threaded;
+		long long sum = 0;
+		for(int i = 0;i < handlers;++i) {
+			auto handler = [&sum, i](int value) {
+				sum += value + i;
+			};
+			immediate.onTick(handler);
+			deferred.onTick(handler);
+			threaded.onQuote(handler);
+		}
+		const long long emits = std::max(2000000 / handlers, 2000);
+		measure("emit/immediate", param("handlers", handlers), emits / 20, 20, [&](long long batch) {
+			for(long long i = 0;i < batch;++i) {
+				immediate.triggerTick(int(i));
+			}
+		});
+		measure("emit/deferred", param("handlers", handlers), emits / 20, 20, [&](long long batch) {
+			for(long long i = 0;i < batch;++i) {
+				deferred.triggerTick(int(i));
+			}
+			deferred.runAllDeferred();
+		});
+		measure("emit/threaded", param("handlers", handlers), emits / 20, 20, [&](long long batch) {
+			for(long long i = 0;i < batch;++i) {
+				threaded.triggerQuote(int(i));
+			}
+		});
+		sink += sum;
+	}
+}
+
+template<int I> struct AddTick {
+	long long* sum;
+	void operator()(int value) const {
+		*sum += value + I;
+	}
+};
+template<int... I> static auto staticTicks(long long* sum, std::integer_sequence<int, I...>) {
+	return EE::makeStaticEmitter(AddTick<I>{sum}...);
+}
+
+// the handlers of emit/immediate in a StaticEventEmitter
+template<int Handlers> static void staticScaling()
+{
+	long long sum = 0;
+	auto fixed = staticTicks(&sum, std::make_integer_sequence<int, Handlers>());
+	// a volatile argument keeps the compiler from folding the whole loop
+	volatile int value = 1;
+	measure("emit/static", param("handlers", Handlers), 2000000 / Handlers / 20, 20, [&](long long batch) {
+		for(long long i = 0;i < batch;++i) {
+			fixed.trigger(int(value));
+		}
+	});
+	sink += sum;
+}
+
+// handler-major batches of 1000 events
+static void batchScaling()
+{
+	std::vector<std::tuple<int>> events;
+	for(int i = 0;i < 1000;++i) {
+		events.emplace_back(i);
+	}
+	for(int handlers = 1;handlers <= 1000;handlers *= 10) {
+		TickEventEmitter provider;
+		QuoteThreadedEventEmitter threaded;
+		long long sum = 0;
+		for(int i = 0;i < handlers;++i) {
+			provider.onTick([&sum, i](int value) {
+				sum += value + i;
+			});
+			threaded.onQuote([&sum, i](int value) {
+				sum += value + i;
+			});
+		}
+		const int batches = std::max(2000 / handlers, 20);
+		measure("emit/batch", param("handlers", handlers), events.size() * (batches / 20), 20, [&](long long batch) {
+			for(long long b = 0;b < batch;b += events.size()) {
+				provider.triggerTickBatch(events);
+			}
+		});
+		measure("emit/threaded-batch", param("handlers", handlers), events.size() * (batches / 20), 20, [&](long long batch) {
+			for(long long b = 0;b < batch;b += events.size()) {
+				threaded.triggerQuoteBatch(events);
+			}
+		});
+		sink += sum;
+	}
+}
+
+// many threads triggering one threaded emitter at once
+static void threadedEmitScaling()
+{
+	for(int threads = 1;threads <= 8;threads *= 2) {
+		QuoteThreadedEventEmitter provider;
+		std::atomic<long long> sum(0);
+		for(int i = 0;i < 10;++i) {
+			provider.onQuote([&sum](int value) {
+				if(value < 0) {
+					sum += value;
+				}
+			});
+		}
+		measure("emit/threaded-mt", param("threads", threads), 200000, 5, [&](long long batch) {
+			std::vector<std::thread> workers;
+			for(int t = 0;t < threads;++t) {
+				workers.emplace_back([&] {
+					for(long long i = 0;i < batch / threads;++i) {
+						provider.triggerQuote(int(i));
+					}
+				});
+			}
+			for(auto& worker : workers) {
+				worker.join();
+			}
+		});
+		assert(sum == 0);
+	}
+}
+
+// serial against parallel fan-out by handler count and handler cost
+static void parallelScaling()
+{
+	for(int handlers = 16;handlers <= 1024;handlers *= 4) {
+		for(int work = 0;work <= 1000;work += 1000) {
+			QuoteThreadedEventEmitter provider;
+			std::atomic<long long> sum(0);
+			for(int i = 0;i < handlers;++i) {
+				provider.onQuote([&sum, work](int value) {
+					volatile int spin = 0;
+					for(int j = 0;j < work;++j) {
+						spin = spin + 1;
+					}
+					if(value < 0) {
+						sum += spin;
+					}
+				});
+			}
+			const long long emits = std::max(4000000 / handlers / (work + 10), 10);
+			const std::string parameter = param("handlers", handlers) + "," + param("work", work);
+			measure("parallel/serial", parameter, emits, 10, [&](long long batch) {
+				for(long long i = 0;i < batch;++i) {
+					provider.triggerQuote(int(i));
+				}
+			});
+			measure("parallel/fanout", parameter, emits, 10, [&](long long batch) {
+				for(long long i = 0;i < batch;++i) {
+					provider.parallelTriggerQuote(int(i));
+				}
+			});
+			assert(sum == 0);
+		}
+	}
+}
+
+// replaces handlers at pseudo-random positions while others stay registered
+static void churnScaling()
+{
+	for(int handlers = 100;handlers <= 10000;handlers *= 10) {
+		TickEventEmitter provider;
+		QuoteThreadedEventEmitter threaded;
+		long long sum = 0;
+		std::vector<handle_id_type> handles;
+		std::vector<handle_id_type> threadedHandles;
+		for(int i = 0;i < handlers;++i) {
+			handles.push_back(provider.onTick([&sum](int value) {
+				sum += value;
+			}));
+			threadedHandles.push_back(threaded.onQuote([&sum](int value) {
+				sum += value;
+			}));
+		}
+		unsigned seed = 1;
+		measure("churn/on+remove", param("handlers", handlers), 50000, 20, [&](long long batch) {
+			for(long long i = 0;i < batch;++i) {
+				seed = seed * 1103515245 + 12345;
+				auto& handle = handles[(seed >> 8) % handlers];
+				provider.removeTickHandler(handle);
+				handle = provider.onTick([&sum](int value) {
+					sum += value;
+				});
+			}
+		});
+		assert(provider.countTickHandlers() == handlers);
+		measure("churn/threaded-on+remove", param("handlers", handlers), std::max(500000 / handlers, 100), 20, [&](long long batch) {
+			for(long long i = 0;i < batch;++i) {
+				seed = seed * 1103515245 + 12345;
+				auto& handle = threadedHandles[(seed >> 8) % handlers];
+				threaded.removeQuoteHandler(handle);
+				handle = threaded.onQuote([&sum](int value) {
+					sum += value;
+				});
+			}
+		});
+		assert(threaded.countQuoteHandlers() == handlers);
+	}
+}
+
+// threads adding and removing handlers of their own threaded emitter,
+// old handler lists of all emitters are reclaimed through one epoch
+static void threadedChurnScaling()
+{
+	for(int threads = 1;threads <= 8;threads *= 2) {
+		std::vector<std::unique_ptr<QuoteThreadedEventEmitter>> providers;
+		for(int t = 0;t < threads;++t) {
+			providers.emplace_back(new QuoteThreadedEventEmitter());
+		}
+		measure("churn/threaded-mt", param("threads", threads), 200000, 5, [&](long long batch) {
+			std::vector<std::thread> workers;
+			for(int t = 0;t < threads;++t) {
+				workers.emplace_back([&, t] {
+					QuoteThreadedEventEmitter& provider = *providers[t];
+					for(long long i = 0;i < batch / threads;++i) {
+						provider.removeQuoteHandler(provider.onQuote([](int) {}));
+					}
+				});
+			}
+			for(auto& worker : workers) {
+				worker.join();
+			}
+		});
+	}
+}
+
+// 10 once handlers re-registered after every deferred trigger, one op is
+// a trigger, its run and the re-registration
+static void onceChurn()
 {
 	TestDeferredEventEmitter provider;
-	
 	int counter[10] = {0,};
 	auto setupHandlers = [&] {
 		for(int i = 0;i < 10;++i) {
@@ -17,14 +381,293 @@ int main(void)
 		}
 	};
 	setupHandlers();
-	for(int i =0; i < 100000;++i) {
-		provider.triggerTest();
-		provider.runAllDeferred();
-		setupHandlers();
-	}
+	measure("churn/once", param("handlers", 10), 5000, 20, [&](long long batch) {
+		for(long long i = 0;i < batch;++i) {
+			provider.triggerTest();
+			provider.runAllDeferred();
+			setupHandlers();
+		}
+	});
 	provider.runAllDeferred();
 	for(int i = 0;i < 10;++i) {
-		assert(counter[i] == 100000);
+		assert(wanted("churn/once") ? counter[i] == 100000 : counter[i] == 0);
+	}
+}
+
+// dispatching by name through a hash table or an interned id, against the
+// std::multimap the dispatcher used before
+static void dispatchScaling()
+{
+	for(int names = 10;names <= 100000;names *= 100) {
+		std::vector<std::string> keys;
+		for(int i = 0;i < names;++i) {
+			keys.push_back("event/" + std::to_string(i * 7919));
+		}
+		std::vector<int> order;
+		unsigned seed = 1;
+		for(int i = 0;i < 1 << 20;++i) {
+			seed = seed * 1103515245 + 12345;
+			order.push_back((seed >> 8) % names);
+		}
+		long long sum = 0;
+		size_t next = 0;
+		auto lookup = [&](auto&& trigger) {
+			return [&, trigger](long long batch) {
+				for(long long i = 0;i < batch;++i) {
+					trigger(order[next++ & (order.size() - 1)]);
+				}
+			};
+		};
+
+		std::multimap<std::string, EE::InplaceFunction<void(int)>> map;
+		TickEventDispatcherTpl<TickEventEmitterTpl, std::string, int> dispatcher;
+		std::vector<EE::EventId> ids;
+		for(auto& key : keys) {
+			map.emplace(key, [&sum](int value) {
+				sum += value;
+			});
+			dispatcher.onTick(key, [&sum](int value) {
+				sum += value;
+			});
+			ids.push_back(dispatcher.internTick(key));
+		}
+		measure("dispatch/multimap", param("names", names), 50000, 20, lookup([&](int i) {
+			auto range = map.equal_range(keys[i]);
+			for(auto it = range.first;it != range.second;++it) {
+				it->second(i);
+			}
+		}));
+		measure("dispatch/name", param("names", names), 50000, 20, lookup([&](int i) {
+			dispatcher.triggerTick(keys[i], i);
+		}));
+		measure("dispatch/id", param("names", names), 50000, 20, lookup([&](int i) {
+			dispatcher.triggerTickById(ids[i], i);
+		}));
+		sink += sum;
+	}
+}
+
+// threads triggering names of their own and now and then adding and
+// removing a handler on one, through a plain dispatcher behind a mutex and
+// through a threaded one, whose names are sharded
+static void concurrentDispatchScaling()
+{
+	for(int threads = 1;threads <= 8;threads *= 2) {
+		std::vector<std::vector<std::string>> keys(threads);
+		for(int t = 0;t < threads;++t) {
+			for(int i = 0;i < 64;++i) {
+				keys[t].push_back("thread" + std::to_string(t) + "/event" + std::to_string(i));
+			}
+		}
+		auto run = [&](long long batch, auto&& trigger, auto&& churn) {
+			std::vector<std::thread> workers;
+			for(int t = 0;t < threads;++t) {
+				workers.emplace_back([&, t] {
+					for(long long i = 0;i < batch / threads;++i) {
+						const std::string& key = keys[t][i & 63];
+						if(i % 16 == 0) {
+							churn(key);
+						}
+						trigger(key, int(i));
+					}
+				});
+			}
+			for(auto& worker : workers) {
+				worker.join();
+			}
+		};
+		std::atomic<long long> sum(0);
+		auto add = [&sum](int value) {
+			if(value < 0) {
+				sum += value;
+			}
+		};
+
+		std::mutex lock;
+		TickEventDispatcherTpl<TickEventEmitterTpl, std::string, int> locked;
+		TickEventDispatcherTpl<TickThreadedEventEmitterTpl, std::string, int> sharded;
+		for(auto& names : keys) {
+			for(auto& key : names) {
+				locked.onTick(key, add);
+				sharded.onTick(key, add);
+			}
+		}
+		measure("dispatch-mt/locked", param("threads", threads), 200000, 5, [&](long long batch) {
+			run(batch, [&](const std::string& key, int value) {
+				std::lock_guard<std::mutex> guard(lock);
+				locked.triggerTick(key, value);
+			}, [&](const std::string& key) {
+				std::lock_guard<std::mutex> guard(lock);
+				locked.removeTickHandler(key, locked.onTick(key, add));
+			});
+		});
+		measure("dispatch-mt/sharded", param("threads", threads), 200000, 5, [&](long long batch) {
+			run(batch, [&](const std::string& key, int value) {
+				sharded.triggerTick(key, value);
+			}, [&](const std::string& key) {
+				sharded.removeTickHandler(key, sharded.onTick(key, add));
+			});
+		});
+		assert(sum == 0);
 	}
+}
+
+// queueing n events and running them, as is and coalesced
+static void deferredScaling()
+{
+	TestDeferredEventEmitter provider;
+	long long counter = 0;
+	provider.onTest([&] {
+		counter++;
+	});
+	for(long long n = 10;n <= 10000000;n *= 10) {
+		const int samples = int(std::min(std::max(1000000 / n, 5LL), 100LL));
+		for(int coalescing = 0;coalescing < 2;++coalescing) {
+			provider.setTestCoalescing(coalescing);
+			measure(coalescing ? "deferred/coalesced" : "deferred/queued", param("queued", n), n, samples, [&](long long batch) {
+				counter = 0;
+				for(long long i = 0;i < batch;++i) {
+					provider.triggerTest();
+				}
+				provider.runAllDeferred();
+				assert(counter == (coalescing ? 1 : batch));
+			});
+		}
+	}
+	provider.setTestCoalescing(false);
+}
+
+// producers queueing while one consumer runs the queue
+static void mpscScaling()
+{
+	for(int producers = 1;producers <= 16;producers *= 2) {
+		TickDeferredEventEmitter provider;
+		long long received = 0;
+		provider.onTick([&](int) {
+			received++;
+		});
+		measure("deferred/mpsc", param("producers", producers), 200000, 5, [&](long long batch) {
+			const long long target = received + batch;
+			std::atomic<bool> go(false);
+			std::vector<std::thread> threads;
+			for(int p = 0;p < producers;++p) {
+				threads.emplace_back([&] {
+					while(!go.load()) {
+						std::this_thread::yield();
+					}
+					for(long long i = 0;i < batch / producers;++i) {
+						provider.triggerTick(int(i));
+					}
+				});
+			}
+			go.store(true);
+			while(received < target) {
+				provider.runAllDeferred();
+			}
+			for(auto& thread : threads) {
+				thread.join();
+			}
+		});
+	}
+}
+
+// draining a deferred dispatcher with 64 keys on one or more threads
+static void parallelDrainScaling()
+{
+	typedef TickEventDispatcherTpl<TickDeferredEventEmitterTpl, int, int> Dispatcher;
+	for(size_t threads = 1;threads <= 4;threads *= 2) {
+		EE::ThreadPool pool(threads - 1 ? threads - 1 : 1);
+		Dispatcher dispatcher;
+		std::vector<long long> sums(64);
+		std::vector<EE::EventId> ids;
+		for(int key = 0;key < 64;++key) {
+			ids.push_back(dispatcher.internTick(key));
+			dispatcher.onTickById(ids.back(), [&sums, key](int value) {
+				volatile int spin = 0;
+				for(int j = 0;j < 200;++j) {
+					spin = spin + 1;
+				}
+				sums[key] += value;
+			});
+		}
+		measureTimed("deferred/drain-parallel", param("threads", threads), 100000, 3, [&](long long batch) {
+			for(long long i = 0;i < batch;++i) {
+				dispatcher.triggerTickById(ids[i % 64], int(i));
+			}
+			long long start = nowNs();
+			dispatcher.runDeferredParallel(pool, threads, EE::DeferredOrder::perKey);
+			return nowNs() - start;
+		});
+		assert(!wanted("deferred/drain-parallel") || sums[0] != 0);
+	}
+}
+
+// from a trigger on another thread until the waiting thread runs again,
+// the event carries the time it was triggered at
+static void waitLatency()
+{
+	StampThreadedEventEmitter provider;
+	std::atomic<bool> done(false);
+	std::thread trigger([&] {
+		while(!done.load()) {
+			provider.triggerStamp(nowNs());
+			std::this_thread::yield();
+		}
+	});
+	measureTimed("wait/waitX", "", 1, 2000, [&](long long) {
+		long long stamp = 0;
+		bool woken = provider.waitStamp([&stamp](long long at) {
+			stamp = at;
+		}, std::chrono::seconds(10));
+		assert(woken);
+		return nowNs() - stamp;
+	});
+	measureTimed("wait/futureOnceX", "", 1, 2000, [&](long long) {
+		long long stamp = std::get<0>(provider.futureOnceStamp().get());
+		return nowNs() - stamp;
+	});
+	done.store(true);
+	trigger.join();
+}
+
+int main(int argc, char** argv)
+{
+	for(int i = 1;i < argc;++i) {
+		if(!strcmp(argv[i], "--json")) {
+			jsonOutput = true;
+		}
+		else {
+			filter = argv[i];
+		}
+	}
+#ifdef EVENTEMITTER_LOCKFREE_DEFERRED
+	const char* queue = "lock-free";
+#else
+	const char* queue = "mutex";
+#endif
+	if(jsonOutput) {
+		printf("{\"suite\": \"EventEmitter\", \"queue\": \"%s\", \"threads\": %u}\n", queue, std::thread::hardware_concurrency());
+	}
+	else {
+		printf("# deferred queue: %s, %u hardware threads, percentiles are of batch means, not single ops\n", queue, std::thread::hardware_concurrency());
+		printf("%-24s %-20s %10s %10s %10s %10s %10s %10s\n", "benchmark", "param", "ns/op", "sample p50", "p90", "p99", "max", "allocs/op");
+	}
+
+	emitScaling();
+	staticScaling<1>();
+	staticScaling<10>();
+	staticScaling<100>();
+	batchScaling();
+	threadedEmitScaling();
+	parallelScaling();
+	churnScaling();
+	threadedChurnScaling();
+	onceChurn();
+	dispatchScaling();
+	concurrentDispatchScaling();
+	deferredScaling();
+	mpscScaling();
+	parallelDrainScaling();
+	waitLatency();
 	return 0;
 }
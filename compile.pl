@@ -24,7 +24,9 @@ for my $line(@lines) {
 
 	if($line =~ /^(.*)\/\/_\/\/$/) {
 		$macro_mode = 0;
-		print $1 . " \n";
+		my $out = $1;
+		$out =~ s/\s+$//;
+		print $out . "\n";
 		next;
 	}
 
@@ -39,5 +41,6 @@ for my $line(@lines) {
 		next;
 	}
 
+	$line =~ s/\s+$//;
 	print $line . "\n";
 }
\ No newline at end of file
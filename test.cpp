@@ -1,8 +1,34 @@
 #define _GLIBCXX_USE_NANOSLEEP
+#include <atomic>
+#include <memory>
+
+// counts the allocations the library makes through EVENTEMITTER_ALLOCATOR
+static std::atomic<long> libraryAllocations(0);
+template<typename T> struct CountingAllocator {
+	typedef T value_type;
+	CountingAllocator() {}
+	template<typename U> CountingAllocator(const CountingAllocator<U>&) {}
+	T* allocate(std::size_t n) {
+		libraryAllocations++;
+		return std::allocator<T>().allocate(n);
+	}
+	void deallocate(T* p, std::size_t n) {
+		std::allocator<T>().deallocate(p, n);
+	}
+	template<typename U> bool operator==(const CountingAllocator<U>&) const { return true; }
+	template<typename U> bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+#define EVENTEMITTER_ALLOCATOR CountingAllocator
 #include "EventEmitter.sane.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 class test_exception: public std::exception
 {
@@ -14,6 +40,33 @@ public:
 	}
 };
 
+// counts every heap allocation made by the tests
+static std::atomic<long> allocations(0);
+void* operator new(std::size_t size) {
+	allocations++;
+	if(void* p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+// counts copies of an event payload
+struct CopyCounter {
+	static int copies;
+	CopyCounter() {}
+	CopyCounter(const CopyCounter&) { copies++; }
+	CopyCounter(CopyCounter&&) {}
+	CopyCounter& operator=(const CopyCounter&) { copies++; return *this; }
+	CopyCounter& operator=(CopyCounter&&) { return *this; }
+};
+int CopyCounter::copies = 0;
+
 template <typename X, typename A>
 inline void Assert(A assertion, const char* msg = "")
 {
@@ -33,6 +86,31 @@ void runTest(std::function<void()> test, const std::string& str) {
 	}
 }
 
+#ifdef __EVENTEMITTER_COROUTINES
+// runs eagerly up to its first co_await and owns the frame, so a test can
+// destroy a coroutine while it is suspended
+struct Task {
+	struct promise_type {
+		Task get_return_object() {
+			return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+	std::coroutine_handle<promise_type> handle;
+	explicit Task(std::coroutine_handle<promise_type> _handle) : handle(_handle) {}
+	Task(Task&& other) : handle(other.handle) { other.handle = nullptr; }
+	~Task() {
+		if(handle) {
+			handle.destroy();
+		}
+	}
+	bool done() const { return handle.done(); }
+};
+#endif
+
 
 typedef ExampleEventEmitterTpl<int, int, std::string> ExampleEventEmitterImpl;
 typedef ExampleDeferredEventEmitterTpl<int, int, std::string> ExampleDeferredEventEmitterImpl;
@@ -102,21 +180,296 @@ int main()
 		test.removeAllExampleHandlers();
 		assert(sum == 32, "all handlers should have been removed");
 	}, "EventEmitter - removeAllHandlers");
+
+	runTest([] {
+		ExampleEventEmitterImpl test;
+		std::vector<ExampleEventEmitterImpl::Handle> handles;
+		std::string order;
+		for(int i = 0;i < 40;++i) {
+			handles.push_back(test.onExample([&, i](int a, int b, std::string str) {
+				order += char('a' + i % 26);
+			}));
+		}
+		for(int i = 0;i < 40;++i) {
+			if(i % 4 != 1) {
+				assert(test.removeExampleHandler(handles[i]), "removeExampleHandler: should find handler");
+			}
+		}
+		assert(!test.removeExampleHandler(handles[0]), "removeExampleHandler: should not remove twice");
+		assert(test.countExampleHandlers() == 10, "countExampleHandlers: should count live handlers");
+		test.triggerExample(0, 0, "");
+		assert(order == "bfjnrvzdhl", "handlers should run in registration order");
+		assert(test.removeExampleHandler(handles[37]), "removeExampleHandler: should find handler after compaction");
+		assert(test.countExampleHandlers() == 9, "countExampleHandlers: should count live handlers");
+	}, "EventEmitter - handler order and count after removals");
+
+	runTest([] {
+		ExampleEventEmitterImpl test;
+		int sum = 0;
+		auto first = test.onExample([&](int a, int b, std::string str) {
+			sum += 1;
+		});
+		assert(test.removeExampleHandler(first), "removeExampleHandler: should find handler");
+		auto second = test.onExample([&](int a, int b, std::string str) {
+			sum += 10;
+		});
+		assert(first != second, "a reused slot should get a new handle");
+		assert(!test.removeExampleHandler(first), "removeExampleHandler: stale handle should not match");
+		test.triggerExample(0, 0, "");
+		assert(sum == 10, "handler in reused slot should still run");
+		test.removeAllExampleHandlers();
+		assert(!test.removeExampleHandler(second), "removeExampleHandler: handle should be gone after removeAll");
+		auto third = test.onceExample([&](int a, int b, std::string str) {
+			sum += 100;
+		});
+		test.triggerExample(0, 0, "");
+		assert(!test.removeExampleHandler(third), "removeExampleHandler: once handler should be gone after running");
+		assert(sum == 110 && test.countExampleHandlers() == 0, "once handler should run once");
+	}, "EventEmitter - stale handles after slot reuse");
+
+	runTest([] {
+		ExampleEventEmitterImpl test;
+		int sum = 0;
+		void *a = &sum, *b = &test, *c = nullptr;
+		auto cycle = [&] {
+			auto handle = test.onExample([&sum, a, b, c](int x, int y, std::string str) {
+				sum += x + y;
+			});
+			test.onceExample([&sum, a, b, c](int x, int y, std::string str) {
+				sum -= x;
+			});
+			test.triggerExample(1, 2, "A");
+			test.removeExampleHandler(handle);
+		};
+		for(int i = 0;i < 32;++i) {
+			cycle();
+		}
+		long before = allocations;
+		for(int i = 0;i < 1000;++i) {
+			cycle();
+		}
+		assert(allocations == before, "on, trigger, remove: should not allocate once storage is warm");
+		assert(sum == 1032 * 2, "handlers should have run");
+	}, "EventEmitter - register, emit, unregister without allocations");
+
+	runTest([] {
+		ExampleEventEmitterTpl<int> test;
+		long before = libraryAllocations;
+		test.onExample([](int) {});
+		assert(libraryAllocations > before, "EVENTEMITTER_ALLOCATOR: should allocate the handler arrays");
+		before = libraryAllocations;
+		std::array<char, 256> big{};
+		test.onExample([big](int) {
+			(void)big;
+		});
+		assert(libraryAllocations > before, "EVENTEMITTER_ALLOCATOR: should allocate oversized handlers");
+		before = libraryAllocations;
+#ifdef EVENTEMITTER_STATS
+		long all = allocations;
+		test.triggerExample(1);
+		assert(libraryAllocations - before == 1 && allocations - all == 1, "EVENTEMITTER_ALLOCATOR: should allocate stats shards on the first emit");
+		before = libraryAllocations;
+#endif
+		test.triggerExample(1);
+		assert(libraryAllocations == before, "trigger: should not allocate");
+		
+		// every allocation of a dispatcher's names and handlers goes through it
+		auto onlyLibrary = [](auto&& body) {
+			long all = allocations;
+			long library = libraryAllocations;
+			body();
+			return allocations - all == libraryAllocations - library && allocations > all;
+		};
+		ExampleEventDispatcherTpl<ExampleEventEmitterTpl, int, int> dispatcher;
+		assert(onlyLibrary([&] {
+			for(int i = 0;i < 100;++i) {
+				dispatcher.onExample(i, [](int) {});
+			}
+		}), "EVENTEMITTER_ALLOCATOR: should allocate dispatcher names");
+#ifndef EVENTEMITTER_DISABLE_THREADING
+		ExampleThreadedEventEmitterTpl<int> threaded;
+		assert(onlyLibrary([&] {
+			threaded.removeExampleHandler(threaded.onExample([](int) {}));
+			threaded.onExample([](int) {});
+		}), "EVENTEMITTER_ALLOCATOR: should allocate Threaded snapshots");
+		ExampleEventDispatcherTpl<ExampleThreadedEventEmitterTpl, int, int> sharded;
+		assert(onlyLibrary([&] {
+			for(int i = 0;i < 100;++i) {
+				sharded.onExample(i, [](int) {});
+			}
+		}), "EVENTEMITTER_ALLOCATOR: should allocate sharded dispatcher names");
+#endif
+	}, "EventEmitter - EVENTEMITTER_ALLOCATOR");
+
+	runTest([] {
+		ExampleEventEmitterTpl<int> test;
+		std::string order;
+		auto add = [&](const char* name, int priority) {
+			return test.onExample([&order, name](int) {
+				order += name;
+			}, priority);
+		};
+		add("a", 0);
+		handle_id_type log = add("l", -10);
+		add("b", 0);
+		handle_id_type check = add("v", 10);
+		add("w", 10);
+		test.triggerExample(1);
+		assert(order == "vwabl", "priority: should run higher priorities first, in order within one");
+		
+		assert(test.removeExampleHandler(check) && !test.removeExampleHandler(check), "remove: should find a handler moved by an insert");
+		test.onceExample([&](int) {
+			order += "o";
+			add("n", 20);
+			add("m", -20);
+		}, 5);
+		order.clear();
+		test.triggerExample(1);
+		assert(order == "woabl", "priority: handlers added while triggering should run from the next trigger");
+		order.clear();
+		test.triggerExample(1);
+		assert(order == "nwablm", "priority: handlers added while triggering should be placed by priority");
+		assert(test.removeExampleHandler(log), "remove: should find a handler after placing others");
+		
+		ExampleEventDispatcherTpl<ExampleEventEmitterTpl, std::string, int> dispatcher;
+		order.clear();
+		dispatcher.onExample("e", [&](int) {
+			order += "a";
+		});
+		dispatcher.onExample("e", [&](int) {
+			order += "b";
+		}, 1);
+		dispatcher.triggerExample("e", 1);
+		assert(order == "ba", "dispatcher priority: should run higher priorities first");
+	}, "EventEmitter, EventDispatcher - handler priorities");
+
+	runTest([] {
+		ExampleEventEmitterTpl<int> test;
+		test.onExample([](int) {});
+		test.onExample([](int) {});
+		for(int i = 0;i < 10;i++) {
+			test.triggerExample(i);
+		}
+		EE::StatsSnapshot stats = test.statsExample();
+		assert(stats.handlers == 2, "stats: should count the handlers");
+		
+		ExampleDeferredEventEmitterTpl<int> deferred;
+		deferred.onExample([](int) {});
+		for(int i = 0;i < 5;i++) {
+			deferred.triggerExample(i);
+		}
+		deferred.runAllDeferred();
+		deferred.triggerExample(1);
+		deferred.runDeferred();
+		EE::StatsSnapshot deferredStats = deferred.statsExample();
+		
+		ExampleDeferredEventDispatcherImpl dispatcher;
+		dispatcher.onExample("a", [](int, int, std::string) {});
+		dispatcher.triggerExample("a", 1, 2, "");
+		dispatcher.triggerExample("b", 1, 2, "");
+		dispatcher.runAllDeferred();
+		EE::StatsSnapshot named = dispatcher.statsExample("a");
+#ifdef EVENTEMITTER_STATS
+		assert(stats.emits == 10 && stats.handlerCalls == 20, "stats: should count emits and handler calls");
+		assert(stats.emitLatency.total() == 10 && stats.handlerLatency.total() == 20, "stats: should record latencies");
+		assert(stats.emitLatency.quantile(0.5) > 0, "stats: quantile should be the bucket bound");
+		assert(deferredStats.emits == 6 && deferredStats.residence.total() == 6, "deferred stats: should record residence");
+		assert(deferredStats.queueHighWater == 5, "deferred stats: should record the high-water mark");
+		assert(named.emits == 1 && named.handlers == 1 && named.residence.total() == 2, "dispatcher stats: should count per name");
+#else
+		assert(stats.emits == 0 && deferredStats.residence.total() == 0 && named.handlers == 1, "stats: should be empty when compiled out");
+#endif
+	}, "EventEmitter, EventDeferredEmitter, EventDispatcher - stats");
+
+	runTest([] {
+		std::string order;
+		auto test = EE::makeStaticEmitter([&](int i, const std::string& str) {
+			order += "a" + std::to_string(i) + str;
+		}, [&](int i, const std::string&) {
+			order += "b" + std::to_string(i);
+		});
+		assert(test.countHandlers() == 2 && test.hasHandlers(), "countHandlers: should count the fixed handlers");
+		test.trigger(1, "x");
+		assert(order == "a1xb1", "trigger: should run the handlers in order");
+		
+		auto more = test.on([&](int i, const std::string&) {
+			order += "c" + std::to_string(i);
+		});
+		assert(more.countHandlers() == 3, "on: should return an emitter with one more handler");
+		order.clear();
+		more.trigger(2, std::string());
+		assert(order == "a2b2c2", "on: should keep the handlers of the original");
+		
+		int sum = 0;
+		auto moveOnly = EE::makeStaticEmitter().on([&](const std::unique_ptr<int>& p) {
+			sum += *p;
+		}).on([&](const std::unique_ptr<int>& p) {
+			sum += *p * 2;
+		});
+		moveOnly.emit(std::unique_ptr<int>(new int(5)));
+		assert(sum == 15, "emit: every handler should get the same argument");
+		std::unique_ptr<int> one(new int(1));
+		long before = allocations;
+		moveOnly.trigger(one);
+		moveOnly.handler<1>()(one);
+		assert(allocations == before && sum == 20, "trigger: should call the stored handlers without allocating");
+	}, "StaticEventEmitter - trigger, on");
 	
 	
-	// TODO: make this work!!
-	// 		runTest([] {
-	// 			ExampleEventEmitter test;
-	// 			
-	// 			int sum = 0;
-	// 			ExampleEventEmitter::HandlerPtr ptr =  test.onExample([&](int a, int b, std::string str) {
-	// 				sum += a;
-	// 				test.removeExampleHandler(ptr);
-	// 			});
-	// 			test.triggerExample(11, 13, "B");
-	// 			assert(sum == 11, "removeExampleHandler: third trigger should not run");
-	// 			assert(sum == 16, "removeExampleHandler: once handler should have been removed");			
-	// 		}, "EventEmitter - removeHandler from within self");
+	runTest([] {
+		ExampleEventEmitterImpl test;
+		
+		int sum = 0;
+		handle_id_type handle = test.onExample([&](int a, int b, std::string str) {
+			sum += a;
+			test.removeExampleHandler(handle);
+		});
+		test.triggerExample(11, 13, "B");
+		test.triggerExample(11, 13, "B");
+		assert(sum == 11, "removeExampleHandler: second trigger should not run");
+		assert(!test.hasExampleHandlers(), "removeExampleHandler: handler should have been removed");
+	}, "EventEmitter - removeHandler from within self");
+
+	runTest([] {
+		ExampleEventEmitterImpl test;
+		std::string order;
+		handle_id_type second = 0;
+		test.onExample([&](int a, int b, std::string str) {
+			order += 'a';
+			test.removeExampleHandler(second);
+			test.onExample([&](int a, int b, std::string str) {
+				order += 'c';
+			});
+		});
+		second = test.onExample([&](int a, int b, std::string str) {
+			order += 'b';
+		});
+		test.onceExample([&](int a, int b, std::string str) {
+			order += 'o';
+			if(a > 0) {
+				test.triggerExample(a - 1, b, str);
+			}
+		});
+		assert(test.countExampleHandlers() == 3, "countExampleHandlers: should count handlers");
+		test.triggerExample(1, 0, "");
+		// the nested trigger runs 'a', which adds another 'c' handler
+		assert(order == "aoa", "removed handlers should be skipped, added ones deferred, once handlers run once");
+		assert(test.countExampleHandlers() == 3, "countExampleHandlers: should count added handlers");
+		test.triggerExample(0, 0, "");
+		assert(order == "aoaacc", "added handlers should run on the next trigger");
+		test.onExample([&](int a, int b, std::string str) {
+			order += 'x';
+			test.removeAllExampleHandlers();
+		});
+		test.onExample([&](int a, int b, std::string str) {
+			order += 'y';
+		});
+		order.clear();
+		test.triggerExample(0, 0, "");
+		test.triggerExample(0, 0, "");
+		assert(order.back() == 'x' && order.find('y') == std::string::npos, "removeAllHandlers should stop the running trigger");
+		assert(!test.hasExampleHandlers(), "removeAllHandlers should remove handlers");
+	}, "EventEmitter - add and remove handlers while triggering");
 	runTest([] {
 		int counter1 = 0, counter2 = 0;
 		ExampleDeferredEventEmitterImpl test;
@@ -147,6 +500,218 @@ int main()
 		assert(counter1 == 16, "removeAllHandlers should have removed handler");
 		
 	}, "EventDeferredEmitter - on, once, trigger, removeAllHandlers");
+
+	runTest([] {
+		ExampleDeferredEventEmitterImpl test;
+		std::string order;
+		test.onExample([&](int a, int b, std::string str) {
+			order += str;
+			if(a > 0) {
+				test.triggerExample(a - 1, b, str);
+			}
+		});
+		
+		test.triggerExample(0, 0, "A");
+		test.triggerExample(1, 0, "B");
+		test.triggerExample(0, 0, "C");
+		test.runAllDeferred();
+		assert(order == "ABCB", "runAllDeferred: should keep queue order and run events queued by handlers");
+		assert(!test.runDeferred(), "runAllDeferred: queue should be empty");
+		
+		test.triggerExample(0, 0, "D");
+		test.clearDeferred();
+		test.triggerExample(0, 0, "E");
+		test.runAllDeferred();
+		assert(order == "ABCBE", "clearDeferred: should drop pending events only");
+	}, "EventDeferredEmitter - runAllDeferred order, trigger from handler");
+
+	runTest([] {
+		struct Both : ExampleDeferredEventEmitterTpl<int>, ExampleDeferredEventEmitterTpl<std::string> {} both;
+		ExampleDeferredEventEmitterTpl<int>& ints = both;
+		ExampleDeferredEventEmitterTpl<std::string>& strings = both;
+		std::string order;
+		ints.onExample([&](int i) {
+			if(i < 0) {
+				throw i;
+			}
+			order += std::to_string(i);
+		});
+		strings.onExample([&](const std::string& str) {
+			order += str;
+		});
+		
+		ints.triggerExample(1);
+		strings.triggerExample("a");
+		ints.triggerExample(2);
+		strings.triggerExample("b");
+		both.runDeferred();
+		assert(order == "1", "runDeferred: should run the oldest event of all emitters");
+		both.runAllDeferred();
+		assert(order == "1a2b", "runAllDeferred: should keep trigger order across emitters");
+		
+		ints.triggerExample(-1);
+		strings.triggerExample("c");
+		try {
+			both.runAllDeferred();
+		} catch(int) {
+		}
+		assert(order == "1a2b", "runAllDeferred: should stop at a throwing handler");
+		both.runAllDeferred();
+		assert(order == "1a2bc", "runAllDeferred: should resume after a throwing handler");
+	}, "EventDeferredEmitter - order across emitters sharing the queue");
+
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int> test;
+		std::string order;
+		test.onExample([&](int i) {
+			order += std::to_string(i) + " ";
+			if(i == 1) {
+				test.triggerExample(10);
+				test.runAllDeferred();
+			}
+			if(i == 5) {
+				throw i;
+			}
+		});
+
+		test.triggerExample(1);
+		test.triggerExample(2);
+		test.triggerExample(3);
+		test.runAllDeferred();
+		assert(order == "1 2 3 10 ", "runAllDeferred: a nested call should finish the started batch first");
+
+		order.clear();
+		test.triggerExample(5);
+		test.triggerExample(6);
+		test.triggerExample(7);
+		try {
+			test.runAllDeferred();
+		} catch(int) {
+		}
+		test.triggerExample(8);
+		test.runDeferred();
+		assert(order == "5 6 ", "runDeferred: should run the rest of a started batch first");
+		test.runAllDeferred();
+		assert(order == "5 6 7 8 ", "runAllDeferred: should keep trigger order after a throwing handler");
+
+		order.clear();
+		test.triggerExample(5);
+		test.triggerExample(6);
+		try {
+			test.runAllDeferred();
+		} catch(int) {
+		}
+		test.triggerExample(7);
+		test.clearDeferred();
+		test.runAllDeferred();
+		assert(order == "5 ", "clearDeferred: should drop the rest of a started batch");
+	}, "EventDeferredEmitter - started batch runs before newer events");
+
+#ifndef EVENTEMITTER_DISABLE_THREADING
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int> test;
+		std::vector<int> order;
+		std::atomic<int> running(0);
+		std::atomic<bool> overlapped(false), started(false), second(false);
+		test.onExample([&](int i) {
+			overlapped = overlapped || ++running > 1;
+			if(i == 0) {
+				started = true;
+				for(int spins = 0;spins < 2000 && !second;++spins) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			}
+			order.push_back(i);
+			running--;
+		});
+		for(int i = 0;i < 10;++i) {
+			test.triggerExample(i);
+		}
+		std::thread first([&] {
+			test.runAllDeferred();
+		});
+		while(!started) {
+			std::this_thread::yield();
+		}
+		for(int i = 10;i < 20;++i) {
+			test.triggerExample(i);
+		}
+		std::thread other([&] {
+			second = true;
+			test.runAllDeferred();
+			while(test.runDeferred());
+		});
+		first.join();
+		other.join();
+		assert(!overlapped, "runAllDeferred: two consumers should not run handlers at once");
+		assert(order.size() == 20, "runAllDeferred: two consumers should run every event");
+		for(int i = 0;i < 20;++i) {
+			assert(order[i] == i, "runAllDeferred: two consumers should keep trigger order");
+		}
+	}, "EventDeferredEmitter - runAllDeferred from two threads");
+
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int> test;
+		ExampleDeferredEventDispatcherImpl dispatcher;
+		std::atomic<int> sum(0), named(0);
+		std::atomic<bool> done(false);
+		test.onExample([&](int i) {
+			sum += i;
+		});
+		dispatcher.onExample("a", [&](int, int, std::string) {
+			named++;
+		});
+		std::thread consumer([&] {
+			while(!done) {
+				test.runAllDeferred();
+				dispatcher.runAllDeferred();
+			}
+			test.runAllDeferred();
+			dispatcher.runAllDeferred();
+		});
+		for(int i = 0;i < 1000;++i) {
+			handle_id_type handle = test.onExample([&](int i) {
+				sum += i;
+			});
+			test.triggerExample(1);
+			assert(test.removeExampleHandler(handle), "removeHandler: should find a handler added on another thread");
+			handle_id_type once = dispatcher.onceExample("a", [&](int, int, std::string) {
+				named++;
+			});
+			dispatcher.triggerExample("a", 1, 2, "");
+			dispatcher.removeExampleHandler("a", once);
+		}
+		done = true;
+		consumer.join();
+		assert(sum >= 1000 && sum <= 2000, "on, remove: should not lose events while handlers change");
+		assert(named >= 1000 && named <= 2000, "dispatcher on, remove: should not lose events while handlers change");
+		assert(test.countExampleHandlers() == 1 && dispatcher.countExampleHandlers("a") == 1, "removeHandler: should keep the other handlers");
+	}, "EventDeferredEmitter, EventDeferredDispatcher - change handlers while another thread drains");
+#endif
+
+	runTest([] {
+		ExampleEventEmitterTpl<CopyCounter, std::unique_ptr<int>> test;
+		ExampleDeferredEventEmitterTpl<CopyCounter, std::unique_ptr<int>> deferred;
+		int sum = 0;
+		auto handler = [&](const CopyCounter&, const std::unique_ptr<int>& value) {
+			sum += *value;
+		};
+		for(int i = 0;i < 3;++i) {
+			test.onExample(handler);
+			deferred.onExample(handler);
+		}
+		CopyCounter::copies = 0;
+		test.triggerExample(CopyCounter(), std::unique_ptr<int>(new int(1)));
+		assert(sum == 3, "move-only payload should reach every handler");
+		deferred.triggerExample(CopyCounter(), std::unique_ptr<int>(new int(2)));
+		deferred.runAllDeferred();
+		assert(sum == 9, "move-only payload should be deferred");
+		CopyCounter payload;
+		deferred.triggerExample(payload, std::unique_ptr<int>(new int(1)));
+		deferred.runAllDeferred();
+		assert(CopyCounter::copies == 1, "payload should be copied only when deferring an lvalue");
+	}, "EventEmitter, EventDeferredEmitter - forwarding without copies, move-only payloads");
 		
 	runTest([]{
 		ExampleEventDispatcherImpl dispatcher;
@@ -175,6 +740,67 @@ int main()
 		
 	}, "EventDispatcher - on, trigger");
 
+	runTest([]{
+		ExampleEventDispatcherImpl dispatcher;
+		int count = 0;
+		handle_id_type handle = dispatcher.onExample("test", [&](int a, int b, std::string str) {
+			count++;
+			dispatcher.removeExampleHandler("test", handle);
+			dispatcher.onceExample("test", [&](int a, int b, std::string str) {
+				count += 10;
+				dispatcher.removeAllExampleHandlers("test");
+			});
+		});
+		dispatcher.onceExample("test", [&](int a, int b, std::string str) {
+			count += 100;
+			dispatcher.triggerExample("test", a, b, str);
+		});
+		dispatcher.triggerExample("test", 0, 0, "");
+		assert(count == 101, "removed handler should not run again in a nested trigger");
+		assert(dispatcher.countExampleHandlers("test") == 1, "handler added while triggering should be kept");
+		dispatcher.triggerExample("test", 0, 0, "");
+		dispatcher.triggerExample("test", 0, 0, "");
+		assert(count == 111, "once handler should run once");
+		assert(!dispatcher.hasExampleHandlers("test"), "removeAllHandlers should remove handlers");
+	}, "EventDispatcher - change handlers while triggering");
+
+	runTest([]{
+		ExampleEventDispatcherImpl dispatcher;
+		std::vector<int> counts(1000);
+		for(int i = 0;i < 1000;++i) {
+			dispatcher.onExample("event" + std::to_string(i), [&counts, i](int a, int b, std::string str) {
+				counts[i] += a;
+			});
+		}
+		EE::EventId id = dispatcher.internExample("event500");
+		assert(dispatcher.internExample("event500") == id, "internExample: should return the same id for a name");
+		assert(dispatcher.internExample("event501") != id, "internExample: should return different ids for different names");
+		for(int i = 0;i < 1000;++i) {
+			dispatcher.triggerExample("event" + std::to_string(i), i, 0, "");
+		}
+		dispatcher.triggerExampleById(id, 1, 0, "");
+		dispatcher.onceExampleById(id, [&counts](int a, int b, std::string str) {
+			counts[0] = -1;
+		});
+		dispatcher.triggerExample("event500", 1, 0, "");
+		dispatcher.triggerExample("missing", 1, 0, "");
+		for(int i = 0;i < 1000;++i) {
+			assert(counts[i] == (i == 0 ? -1 : i == 500 ? 502 : i), "each name should reach its own handlers");
+		}
+		assert(dispatcher.countExampleHandlers("event500") == 1, "countExampleHandlers: once handler should be gone");
+		assert(!dispatcher.hasExampleHandlers("missing"), "hasExampleHandlers: unknown name has no handlers");
+		std::vector<std::string> unknown;
+		for(int i = 0;i < 1000;++i) {
+			unknown.push_back("unknown" + std::to_string(i));
+		}
+		long before = libraryAllocations;
+		for(auto& name : unknown) {
+			dispatcher.triggerExample(name, 1, 0, "");
+		}
+		assert(libraryAllocations == before, "triggerExample: should not intern names without handlers");
+		assert(dispatcher.internExample("fresh") == 1000, "triggerExample: should not hand out ids to names without handlers");
+	}, "EventDispatcher - interned ids and many names");
+
 	runTest([]{
 		ExampleDeferredEventDispatcherImpl dispatcher;
 		int sum = 0;
@@ -197,6 +823,276 @@ int main()
 		assert(sum == 16, "should run second callback");
 		
 	}, "EventDeferredDispatcher - on, trigger, runDeferred");
+
+	runTest([]{
+		ExampleDeferredEventEmitterTpl<int> test;
+		std::string order;
+		test.onExample([&](int i) {
+			order += std::to_string(i);
+		});
+		test.setDeferredCapacity(2, EE::DeferredOverflow::dropNewest);
+		assert(test.tryTriggerExample(1) && test.tryTriggerExample(2), "tryTrigger: should queue below capacity");
+		assert(!test.tryTriggerExample(3), "dropNewest: should reject when full");
+		test.runAllDeferred();
+		assert(order == "12", "dropNewest: should keep the queued events");
+		
+		ExampleDeferredEventEmitterTpl<int> nested;
+		order.clear();
+		nested.onExample([&](int i) {
+			order += std::to_string(i);
+			if(i == 1) {
+				// the thread running the queue never waits for room in it
+				nested.triggerExample(2);
+				nested.triggerExample(3);
+			}
+		});
+		nested.setDeferredCapacity(1);
+		nested.triggerExample(1);
+		nested.runAllDeferred();
+		assert(order == "12", "block: should reject instead of waiting on the consumer thread");
+#if !defined(EVENTEMITTER_LOCKFREE_DEFERRED) || defined(EVENTEMITTER_DISABLE_THREADING)
+		order.clear();
+		test.setDeferredCapacity(2, EE::DeferredOverflow::dropOldest);
+		for(int i = 1;i <= 4;i++) {
+			test.triggerExample(i);
+		}
+		test.runAllDeferred();
+		assert(order == "34", "dropOldest: should keep the newest events");
+		
+		order.clear();
+		test.setDeferredCapacity(2, EE::DeferredOverflow::coalesce);
+		for(int i = 1;i <= 4;i++) {
+			test.triggerExample(i);
+		}
+		test.runAllDeferred();
+		assert(order == "14", "coalesce: should overwrite the newest pending event");
+		
+		ExampleDeferredEventDispatcherImpl dispatcher;
+		order.clear();
+		dispatcher.onExample("a", [&](int a, int, std::string) {
+			order += "a" + std::to_string(a);
+		});
+		dispatcher.onExample("b", [&](int b, int, std::string) {
+			order += "b" + std::to_string(b);
+		});
+		dispatcher.setDeferredCapacity(2, EE::DeferredOverflow::coalesce);
+		dispatcher.triggerExample("a", 1, 0, "");
+		dispatcher.triggerExample("b", 1, 0, "");
+		dispatcher.triggerExample("a", 2, 0, "");
+		dispatcher.triggerExample("b", 2, 0, "");
+		dispatcher.triggerExample("c", 1, 0, "");
+		dispatcher.runAllDeferred();
+		assert(order == "a2b2", "coalesce: should overwrite the pending event of the same name");
+
+		struct Both : ExampleDeferredEventEmitterTpl<int>, ExampleDeferredEventEmitterTpl<std::string> {} both;
+		ExampleDeferredEventEmitterTpl<int>& ints = both;
+		ExampleDeferredEventEmitterTpl<std::string>& strings = both;
+		order.clear();
+		ints.onExample([&](int i) {
+			order += std::to_string(i);
+		});
+		strings.onExample([&](std::string s) {
+			order += s;
+		});
+		both.setDeferredCapacity(1, EE::DeferredOverflow::coalesce);
+		int first = 1, second = 2;
+		ints.triggerExampleByRef(first);
+		strings.triggerExampleBatch(std::vector<std::tuple<std::string>>{std::make_tuple(std::string("a"))});
+		both.runAllDeferred();
+		assert(order == "1", "coalesce: should not overwrite a closure of another emitter");
+
+		order.clear();
+		ints.triggerExampleByRef(first);
+		ints.triggerExampleByRef(second);
+		both.runAllDeferred();
+		assert(order == "2", "coalesce: should overwrite a closure of the same emitter");
+
+		long before = allocations;
+		test.setDeferredCapacity(4, EE::DeferredOverflow::dropNewest);
+		for(int round = 0;round < 2;round++) {
+			before = allocations;
+			for(int i = 0;i < 8;i++) {
+				test.triggerExample(i);
+			}
+			test.runAllDeferred();
+		}
+		assert(allocations == before, "bounded queue: should not allocate once storage is warm");
+#endif
+	}, "EventDeferredEmitter - bounded queue overflow policies");
+
+	runTest([]{
+		struct Both : ExampleDeferredEventEmitterTpl<int>, ExampleDeferredEventEmitterTpl<std::string> {} both;
+		ExampleDeferredEventEmitterTpl<int>& ints = both;
+		ExampleDeferredEventEmitterTpl<std::string>& strings = both;
+		std::string order;
+		ints.onExample([&](int i) {
+			order += std::to_string(i);
+		});
+		strings.onExample([&](std::string str) {
+			order += str;
+		});
+		ints.setExampleCoalescing();
+		for(int i = 1;i <= 100;i++) {
+			ints.triggerExample(i);
+			if(i == 1) {
+				strings.triggerExample("a");
+			}
+		}
+		both.runAllDeferred();
+#if !defined(EVENTEMITTER_LOCKFREE_DEFERRED) || defined(EVENTEMITTER_DISABLE_THREADING)
+		assert(order == "100a", "coalescing: should run the newest value in the place of the first");
+#else
+		assert(order == "a100", "coalescing: should run the newest value only");
+#endif
+		ints.setExampleCoalescing(false);
+		order.clear();
+		ints.triggerExample(1);
+		ints.triggerExample(2);
+		both.runAllDeferred();
+		assert(order == "12", "coalescing: should queue every event once turned off");
+		
+#if !defined(EVENTEMITTER_LOCKFREE_DEFERRED) || defined(EVENTEMITTER_DISABLE_THREADING)
+		ExampleDeferredEventDispatcherImpl dispatcher;
+		order.clear();
+		dispatcher.onExample("a", [&](int a, int, std::string) {
+			order += "a" + std::to_string(a);
+		});
+		dispatcher.onExample("b", [&](int b, int, std::string) {
+			order += "b" + std::to_string(b);
+		});
+		dispatcher.setExampleCoalescing();
+		dispatcher.triggerExample("a", 1, 0, "");
+		dispatcher.triggerExample("b", 1, 0, "");
+		dispatcher.runDeferred();
+		for(int i = 2;i <= 100;i++) {
+			dispatcher.triggerExample("a", i, 0, "");
+			dispatcher.triggerExample("b", i, 0, "");
+		}
+		dispatcher.runAllDeferred();
+		assert(order == "a1b100a100", "coalescing: should keep one pending event per name");
+		
+		ints.setExampleCoalescing();
+		long before = allocations;
+		for(int round = 0;round < 2;round++) {
+			order.clear();
+			before = allocations;
+			for(int i = 0;i < 1000;i++) {
+				ints.triggerExample(i);
+			}
+			both.runAllDeferred();
+		}
+		assert(allocations == before && order == "999", "coalescing: should not allocate once storage is warm");
+#endif
+	}, "EventDeferredEmitter, EventDeferredDispatcher - coalescing");
+
+	runTest([]{
+		ExampleEventEmitterTpl<int, std::string> test;
+		std::string order;
+		test.onExample([&](int i, const std::string& str) {
+			order += "a" + std::to_string(i) + str;
+		});
+		test.onceExample([&](int i, const std::string& str) {
+			order += "o" + std::to_string(i);
+		});
+		handle_id_type self = 0;
+		self = test.onExample([&](int i, const std::string& str) {
+			order += "r" + std::to_string(i);
+			test.removeExampleHandler(self);
+		});
+		test.onExample([&](int i, const std::string& str) {
+			order += "b" + std::to_string(i);
+		});
+		std::vector<std::tuple<int, std::string>> batch{{1, "x"}, {2, "y"}, {3, "z"}};
+		test.triggerExampleBatch(batch);
+		assert(order == "a1xa2ya3zo1r1b1b2b3", "triggerBatch: should run each handler over the whole batch");
+		order.clear();
+		test.triggerExampleBatch(batch.data(), 1);
+		assert(order == "a1xb1", "triggerBatch: once and removed handlers should be gone");
+		
+		ExampleDeferredEventEmitterTpl<int, std::string> deferred;
+		deferred.onExample([&](int i, const std::string& str) {
+			order += "a" + std::to_string(i);
+		});
+		deferred.onExample([&](int i, const std::string& str) {
+			order += "b" + std::to_string(i);
+		});
+		order.clear();
+		deferred.triggerExampleBatch(batch);
+		deferred.triggerExample(4, "w");
+		assert(order.empty(), "deferred triggerBatch: should not run at once");
+		deferred.runAllDeferred();
+		assert(order == "a1a2a3b1b2b3a4b4", "deferred triggerBatch: should run the batch as one event");
+	}, "EventEmitter, EventDeferredEmitter - triggerBatch");
+
+#ifdef __EVENTEMITTER_COROUTINES
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int, std::string> test;
+		std::string got;
+		auto reader = [&]() -> Task {
+			for(int i = 0;i < 3;i++) {
+				auto [n, str] = co_await test.nextExample();
+				got += str + std::to_string(n);
+			}
+		};
+		Task task = reader();
+		test.triggerExample(1, "a");
+		assert(got.empty(), "next: should wait for the deferred event to run");
+		test.runAllDeferred();
+		assert(got == "a1", "next: should resume with the event's arguments");
+		// the pending and draining buffers trade places, so both are warm
+		// after two events
+		test.triggerExample(2, "b");
+		test.runAllDeferred();
+		long before = allocations;
+		test.triggerExample(3, "c");
+		test.runAllDeferred();
+		long awaited = allocations - before;
+		test.triggerExample(4, "d");
+		test.runAllDeferred();
+		assert(got == "a1b2c3", "next: should take one event per co_await");
+		assert(task.done());
+		assert(awaited == 0, "next: should not allocate");
+		
+		{
+			Task suspended = reader();
+		}
+		test.triggerExample(5, "e");
+		test.runAllDeferred();
+		assert(got == "a1b2c3", "next: a destroyed coroutine should no longer wait");
+		
+		got.clear();
+		auto streamer = [&]() -> Task {
+			auto stream = test.streamExample();
+			for(int i = 0;i < 4;i++) {
+				auto [n, str] = co_await stream.next();
+				got += str + std::to_string(n);
+			}
+		};
+		Task streamed = streamer();
+		assert(test.hasExampleHandlers(), "stream: should subscribe");
+		test.triggerExample(1, "a");
+		test.triggerExample(2, "b");
+		test.runAllDeferred();
+		assert(got == "a1b2", "stream: should resume on each event");
+		{
+			auto stream = test.streamExample();
+			test.triggerExample(3, "c");
+			test.triggerExample(4, "d");
+			test.runAllDeferred();
+			auto drain = [&]() -> Task {
+				for(int i = 0;i < 2;i++) {
+					auto [n, str] = co_await stream.next();
+					got += "+" + str;
+				}
+			};
+			Task buffered = drain();
+			assert(buffered.done(), "stream: should not suspend while events are buffered");
+		}
+		assert(got == "a1b2c3d4+c+d", "stream: should keep every event in order");
+		assert(streamed.done());
+		assert(!test.hasExampleHandlers(), "stream: should unsubscribe when destroyed");
+	}, "EventDeferredEmitter - nextExample and streamExample coroutines");
+#endif
 	
 #ifndef	EVENTEMITTER_DISABLE_THREADING
 	runTest([] {
@@ -211,6 +1107,131 @@ int main()
 		});
 		test->runAllDeferred();
 	}, "EventDeferredEmitter - trigger from thread");
+
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int> test;
+		std::atomic<long> ran(0);
+		test.onExample([&](int) {
+			ran++;
+		});
+		for(long round = 1;round <= 50;++round) {
+			std::atomic<bool> producing(true);
+			std::vector<std::thread> producers;
+			for(int p = 0;p < 4;++p) {
+				producers.emplace_back([&] {
+					for(int i = 0;i < 500;++i) {
+						test.triggerExample(i);
+					}
+				});
+			}
+			std::thread consumer([&] {
+				while(producing) {
+					test.runDeferred();
+				}
+			});
+			for(auto& producer : producers) {
+				producer.join();
+			}
+			producing = false;
+			consumer.join();
+			test.runAllDeferred();
+			assert(ran == round * 2000, "runAllDeferred: should run every event queued before it");
+		}
+	}, "EventDeferredEmitter - runAllDeferred after several producers");
+
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int> test;
+		std::vector<int> order;
+		test.onExample([&](int i) {
+			order.push_back(i);
+		});
+		test.setDeferredCapacity(4);
+		std::thread producer([&] {
+			for(int i = 0;i < 1000;i++) {
+				test.triggerExample(i);
+			}
+		});
+		while(order.size() < 1000) {
+			test.runAllDeferred();
+			std::this_thread::yield();
+		}
+		producer.join();
+		for(int i = 0;i < 1000;i++) {
+			assert(order[i] == i, "block: should run every event in order");
+		}
+	}, "EventDeferredEmitter - bounded queue blocks the producer");
+
+	runTest([] {
+		ExampleDeferredEventEmitterTpl<int> test;
+		long sum = 0;
+		test.onExample([&](int i) {
+			sum += i;
+		});
+		auto produce = [&](long& allocated) {
+			long before = allocations;
+			for(int i = 0;i < 1000;i++) {
+				test.triggerExample(i);
+			}
+			allocated = allocations - before;
+		};
+		// the pending and draining buffers trade places, so both are warm
+		// after two rounds; with the lock-free queue each thread takes over
+		// the record arena of the producer before it
+		long allocated = 0;
+		for(int round = 0;round < 3;round++) {
+			std::thread([&] {
+				produce(allocated);
+			}).join();
+			test.runAllDeferred();
+		}
+		assert(sum == 3 * 499500, "should run every event");
+		assert(allocated == 0, "trigger from thread: should not allocate once storage is warm");
+	}, "EventDeferredEmitter - trigger from thread without allocations");
+
+	runTest([]{
+		ExampleThreadedEventEmitterTpl<int> test;
+		std::string order;
+		test.onExample([&](int i) {
+			order += "a" + std::to_string(i);
+		});
+		test.onceExample([&](int i) {
+			order += "o" + std::to_string(i);
+		});
+		std::array<std::tuple<int>, 3> batch{{std::make_tuple(1), std::make_tuple(2), std::make_tuple(3)}};
+		auto future = test.futureOnceExample();
+		test.triggerExampleBatch(batch);
+		assert(order == "a1a2a3o1", "threaded triggerBatch: should run each handler over the whole batch");
+		assert(std::get<0>(future.get()) == 1, "threaded triggerBatch: once handlers should get the first event");
+		order.clear();
+		test.deferExampleBatch(batch.data(), 2);
+		test.runAllDeferred();
+		assert(order == "a1a2", "deferBatch: should run the batch when deferred events run");
+	}, "EventThreadedEmitter - triggerBatch, deferBatch");
+
+	runTest([]{
+		ExampleThreadedEventEmitterTpl<int> test;
+		std::string order;
+		test.onExample([&](int) {
+			order += "a";
+		});
+		test.onExample([&](int) {
+			order += "l";
+		}, -1);
+		test.onExample([&](int) {
+			order += "v";
+		}, 1);
+		test.onExample([&](int) {
+			order += "b";
+		});
+		test.triggerExample(1);
+		assert(order == "vabl", "threaded priority: should run higher priorities first");
+		assert(test.statsExample().handlers == 4, "threaded stats: should count the handlers");
+#ifdef EVENTEMITTER_STATS
+		assert(test.statsExample().emits == 1 && test.statsExample().handlerCalls == 4, "threaded stats: should count emits");
+#endif
+		static_assert(!std::is_base_of<ExampleEventEmitterTpl<int>, ExampleThreadedEventEmitterTpl<int>>::value,
+			"threaded emitter: handlers added through an EventEmitterTpl would never run");
+	}, "EventThreadedEmitter - handler priorities");
 	
 	runTest([]{
 		ExampleThreadedEventEmitterImpl test;
@@ -255,10 +1276,184 @@ int main()
 		}, std::chrono::milliseconds(50));
 		assert(result == false && status == false, "Should have timed out");
 	}, "EventThreadedEmitter - wait for trigger in std::async with timeout");
+
+	runTest([]{
+		// shared with the waiting threads, which are left behind if they hang
+		struct State {
+			ExampleThreadedEventEmitterTpl<int> emitter;
+			std::atomic<int> finished{0};
+			std::atomic<bool> ran{false};
+		};
+		auto state = std::make_shared<State>();
+		std::thread throwing([state] {
+			state->emitter.waitExample([](int) {
+				throw test_exception("waitExample: thrown by the handler");
+			});
+			state->finished++;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		std::thread timed([state] {
+			state->emitter.waitExample([state](int) {
+				state->ran = true;
+			}, std::chrono::milliseconds(500));
+			state->finished++;
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		bool thrown = false;
+		try {
+			state->emitter.triggerExample(1);
+		}
+		catch(test_exception&) {
+			thrown = true;
+		}
+		for(int i = 0;i < 3000 && state->finished < 2;++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		bool finished = state->finished == 2;
+		for(std::thread* thread : {&throwing, &timed}) {
+			if(finished) {
+				thread->join();
+			}
+			else {
+				thread->detach();
+			}
+		}
+		assert(thrown, "waitExample: trigger should rethrow the handler's exception");
+		assert(finished, "waitExample: a throwing handler should not leave waiting threads hanging");
+		assert(state->ran.load(), "waitExample: waiters after a throwing one should still fire");
+	}, "EventThreadedEmitter - wait with a throwing handler");
+
+	runTest([]{
+		ExampleThreadedEventEmitterTpl<int> test;
+		std::atomic<bool> done(false);
+		std::thread trigger([&] {
+			for(int i = 1;!done;i++) {
+				test.triggerExample(i);
+				std::this_thread::yield();
+			}
+		});
+		int last = 0;
+		bool ordered = true;
+		auto wait = [&] {
+			return test.waitExample([&](int i) {
+				ordered = ordered && i > last;
+				last = i;
+			});
+		};
+		wait();
+		long before = allocations;
+		for(int round = 0;round < 100;round++) {
+			wait();
+		}
+		long waited = allocations - before;
+		test.futureOnceExample().get();
+		before = allocations;
+		for(int round = 0;round < 100;round++) {
+			test.futureOnceExample().get();
+		}
+		long futures = allocations - before;
+		bool triggered = test.waitExample(std::chrono::seconds(10));
+		done = true;
+		trigger.join();
+		assert(ordered, "wait: should get a later event each time");
+		assert(waited == 0, "wait: should not allocate");
+		// the promise's shared state and its result, and one more waiter
+		// when the next future comes before the trigger has put back the
+		// last one
+		assert(futures <= 2 * 100 + 1, "futureOnce: should only allocate the promise");
+		assert(triggered, "wait with duration: should return true when triggered");
+		assert(!test.waitExample(std::chrono::milliseconds(1)), "wait: should time out without a trigger");
+
+		std::future<std::tuple<int>> pending;
+		{
+			ExampleThreadedEventEmitterTpl<int> scoped;
+			pending = scoped.futureOnceExample();
+		}
+		bool broken = false;
+		try {
+			pending.get();
+		}
+		catch(const std::future_error&) {
+			broken = true;
+		}
+		assert(broken, "futureOnce: should break the promise when the emitter goes away");
+	}, "EventThreadedEmitter - wait and futureOnce without allocations");
+
+#ifdef __EVENTEMITTER_COROUTINES
+	runTest([] {
+		ExampleThreadedEventEmitterTpl<int> test;
+		EE::ThreadPool pool(1);
+		std::atomic<int> sum(0);
+		std::atomic<bool> finished(false);
+		std::atomic<std::thread::id> resumedOn;
+		auto reader = [&]() -> Task {
+			co_await test.nextExample(EE::PoolResume{&pool});
+			resumedOn = std::this_thread::get_id();
+			auto stream = test.streamExample();
+			while(sum < 1000) {
+				auto [n] = co_await stream.next();
+				sum += n;
+			}
+			finished = true;
+		};
+		Task task = reader();
+		// zeros until the stream has subscribed, only the ones count
+		while(!test.hasExampleHandlers()) {
+			test.triggerExample(0);
+			std::this_thread::yield();
+		}
+		std::thread producer([&] {
+			for(int i = 0;i < 1000;i++) {
+				test.triggerExample(1);
+			}
+		});
+		producer.join();
+		for(int spins = 0;!finished && spins < 10000;spins++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		assert(finished.load(), "stream: should get every trigger from another thread");
+		assert(resumedOn.load() != std::this_thread::get_id(), "next: PoolResume should resume on the pool");
+		assert(sum == 1000);
+		assert(!test.hasExampleHandlers(), "stream: should unsubscribe when destroyed");
+	}, "EventThreadedEmitter - nextExample and streamExample coroutines");
+
+	runTest([] {
+		ExampleThreadedEventEmitterTpl<int> test;
+		// counts the events instead of resuming, the test destroys the frames
+		struct Count {
+			std::atomic<int>* fired;
+			void operator()(std::coroutine_handle<>) const {
+				++*fired;
+			}
+		};
+		std::atomic<int> fired(0);
+		std::atomic<bool> stop(false);
+		std::thread trigger([&] {
+			while(!stop) {
+				test.triggerExample(1);
+			}
+		});
+		for(int i = 0;i < 2000;i++) {
+			auto next = [&]() -> Task {
+				co_await test.nextExample(Count{&fired});
+			};
+			auto stream = [&]() -> Task {
+				auto events = test.streamExample(Count{&fired});
+				co_await events.next();
+			};
+			Task a = next();
+			Task b = stream();
+			std::this_thread::yield();
+		}
+		stop = true;
+		trigger.join();
+		assert(fired > 0, "next, stream: should have been fired while destroyed");
+	}, "EventThreadedEmitter - destroy awaiting coroutines while triggering");
+#endif
 	
 	runTest([]{
 		ExampleThreadedEventEmitterImpl test;
-		bool async = false;
+		std::atomic<bool> async(false);
 		std::thread::id id;
 		test.asyncOnceExample([&](int, int, std::string str) {
 			id = std::this_thread::get_id();
@@ -270,6 +1465,448 @@ int main()
 		while(!async) {}
 		assert(id != std::this_thread::get_id(), "async properly run");
 	}, "EventThreadedEmitter - asyncOnce and defer");
+
+	runTest([]{
+		ExampleThreadedEventEmitterTpl<int> test;
+		std::atomic<int> on(0), once(0), waited(0);
+		std::unique_ptr<int> one(new int(1));
+		bool copied = false;
+		try {
+			test.asyncOnExample([&on, p = std::move(one)](int value) {
+				on += *p * value;
+			});
+			test.asyncOnceExample([&once, p = std::unique_ptr<int>(new int(1))](int value) {
+				once += *p * value;
+			});
+			test.asyncWaitExample([&waited, p = std::unique_ptr<int>(new int(1))](int value) {
+				waited += *p * value;
+			}, std::chrono::seconds(10), [] {});
+		}
+		catch(const std::bad_function_call&) {
+			copied = true;
+		}
+		assert(!copied, "async handlers: move-only handlers should not be copied");
+		for(int i = 0;i < 1000 && !(on && once && waited);++i) {
+			test.triggerExample(1);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		assert(on && once == 1 && waited == 1, "async handlers: move-only handlers should run");
+	}, "EventThreadedEmitter - move-only async handlers");
+
+	runTest([]{
+		ExampleThreadedEventEmitterTpl<int> test, other;
+		std::atomic<int> waited(0), timedOut(0), ran(0);
+		int waits = 2 * std::max(1u, std::thread::hardware_concurrency()) + 2;
+		for(int i = 0;i < waits;++i) {
+			test.asyncWaitExample([&](int value) {
+				waited += value;
+			}, std::chrono::milliseconds::max(), [&] {
+				timedOut++;
+			});
+		}
+		other.asyncOnExample([&](int) {
+			ran++;
+		});
+		other.triggerExample(1);
+		for(int i = 0;i < 2000 && !ran;++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		assert(ran == 1, "asyncWait: pending waits should not hold pool workers");
+		test.triggerExample(1);
+		for(int i = 0;i < 2000 && waited < waits;++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		assert(waited == waits && timedOut == 0, "asyncWait: every wait should see the trigger");
+		test.triggerExample(1);
+		assert(waited == waits, "asyncWait: handlers should run once");
+
+		test.asyncWaitExample([&](int value) {
+			waited += value;
+		}, std::chrono::milliseconds(10), [&] {
+			timedOut++;
+		});
+		for(int i = 0;i < 2000 && !timedOut;++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		test.triggerExample(1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		assert(timedOut == 1 && waited == waits, "asyncWait: a timed out wait should not run its handler");
+
+		{
+			ExampleThreadedEventEmitterTpl<int> dropped;
+			dropped.asyncWaitExample([&](int value) {
+				waited += value;
+			}, std::chrono::seconds(10), [&] {
+				timedOut++;
+			});
+		}
+		assert(timedOut == 1 && waited == waits, "asyncWait: a wait ends with its emitter");
+	}, "EventThreadedEmitter - asyncWait does not hold a pool worker");
+
+	runTest([]{
+		ExampleThreadedEventEmitterImpl test;
+		std::atomic<bool> released(false), sawRelease(false);
+		std::atomic<int> done(0);
+		test.asyncOnExample([&](int, int, std::string str) {
+			for(int i = 0;i < 2000 && !released;++i) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			sawRelease = released.load();
+			done++;
+		});
+		test.triggerExample(0, 0, "");
+		released = true;
+		while(done == 0) {
+			std::this_thread::yield();
+		}
+		assert(sawRelease.load(), "trigger should return before the async handler finishes");
+	}, "EventThreadedEmitter - asyncOn does not block trigger");
+
+	runTest([]{
+		std::atomic<int> count(0);
+		{
+			EE::ThreadPool pool(2, 16);
+			assert(pool.size() == 2, "ThreadPool: should start the requested workers");
+			for(int i = 0;i < 1000;++i) {
+				pool.post([&] {
+					count++;
+					pool.post([&] {
+						count++;
+					});
+				});
+			}
+		}
+		assert(count == 2000, "ThreadPool: should run every task, inline once full");
+	}, "ThreadPool - bounded queue and nested posts");
+
+	runTest([]{
+		ExampleThreadedEventEmitterImpl test;
+		std::vector<handle_id_type> handles[4];
+		std::vector<std::thread> threads;
+		for(int t = 0;t < 4;++t) {
+			threads.emplace_back([&, t] {
+				for(int i = 0;i < 1000;++i) {
+					handles[t].push_back(i % 2 ? test.onceExample([](int, int, std::string) {}) : test.onExample([](int, int, std::string) {}));
+				}
+			});
+		}
+		for(auto& thread : threads) {
+			thread.join();
+		}
+		std::vector<handle_id_type> all;
+		for(auto& h : handles) {
+			all.insert(all.end(), h.begin(), h.end());
+		}
+		std::sort(all.begin(), all.end());
+		assert(std::unique(all.begin(), all.end()) == all.end(), "handles should be unique");
+		assert(test.countExampleHandlers() == 4000, "countExampleHandlers: should count every handler");
+		test.triggerExample(0, 0, "");
+		assert(test.countExampleHandlers() == 2000, "once handlers should have been removed");
+		for(int t = 0;t < 4;++t) {
+			for(int i = 0;i < 1000;i += 2) {
+				assert(test.removeExampleHandler(handles[t][i]), "removeExampleHandler: should find handler");
+			}
+		}
+		assert(!test.hasExampleHandlers(), "all handlers should have been removed");
+	}, "EventThreadedEmitter - concurrent registration hands out unique handles");
+
+	runTest([]{
+		ExampleThreadedEventEmitterImpl test;
+		int count = 0;
+		handle_id_type handle = test.onExample([&](int a, int b, std::string str) {
+			count++;
+			test.removeExampleHandler(handle);
+			test.onceExample([&](int a, int b, std::string str) {
+				count += 10;
+			});
+			test.triggerExample(a, b, str);
+		});
+		test.triggerExample(0, 0, "");
+		assert(count == 11, "handlers should be able to use the emitter they run on");
+		test.triggerExample(0, 0, "");
+		assert(count == 11 && !test.hasExampleHandlers(), "handlers should have been removed");
+	}, "EventThreadedEmitter - handlers re-enter the emitter");
+
+	runTest([]{
+		ExampleThreadedEventEmitterImpl test;
+		std::atomic<int> onceRuns(0);
+		std::atomic<long> runs(0);
+		std::atomic<bool> stop(false);
+		test.onExample([&](int, int, std::string) {
+			runs++;
+		});
+		std::vector<std::thread> threads;
+		for(int t = 0;t < 3;++t) {
+			threads.emplace_back([&] {
+				while(!stop) {
+					test.triggerExample(0, 0, "");
+				}
+			});
+		}
+		for(int i = 0;i < 300;++i) {
+			handle_id_type handle = test.onExample([&](int, int, std::string) {
+				runs++;
+			});
+			test.onceExample([&](int, int, std::string) {
+				onceRuns++;
+			});
+			test.removeExampleHandler(handle);
+		}
+		while(test.countExampleHandlers() > 1) {
+			std::this_thread::yield();
+		}
+		stop = true;
+		for(auto& thread : threads) {
+			thread.join();
+		}
+		assert(onceRuns == 300, "each once handler should run exactly once");
+		assert(runs > 0, "handlers should have run");
+	}, "EventThreadedEmitter - trigger while other threads change handlers");
+
+	runTest([]{
+		ExampleEventDispatcherTpl<ExampleThreadedEventEmitterTpl, std::string, int> dispatcher;
+		std::atomic<long> shared(0);
+		dispatcher.onExample("shared", [&](int value) {
+			shared += value;
+		});
+		const int names = 500;
+		std::vector<long> counts(4);
+		std::vector<std::vector<EE::EventId>> ids(4);
+		std::vector<std::thread> threads;
+		for(int t = 0;t < 4;++t) {
+			threads.emplace_back([&, t] {
+				long& count = counts[t];
+				for(int i = 0;i < names;++i) {
+					std::string name = std::to_string(t) + "/" + std::to_string(i);
+					handle_id_type handle = dispatcher.onExample(name, [&count](int value) {
+						count += value;
+					});
+					dispatcher.onceExample(name, [&count](int value) {
+						count += 10 * value;
+					});
+					dispatcher.triggerExample(name, 1);
+					ids[t].push_back(dispatcher.internExample(name));
+					dispatcher.triggerExampleById(ids[t].back(), 2);
+					dispatcher.removeExampleHandler(name, handle);
+					dispatcher.triggerExample(name, 100);
+					dispatcher.triggerExample("shared", 1);
+				}
+			});
+		}
+		for(auto& thread : threads) {
+			thread.join();
+		}
+		std::vector<EE::EventId> all;
+		for(int t = 0;t < 4;++t) {
+			assert(counts[t] == 13 * names, "each thread should reach only its own names");
+			all.insert(all.end(), ids[t].begin(), ids[t].end());
+		}
+		assert(shared == 4 * names, "concurrent triggers of one name should all run");
+		std::sort(all.begin(), all.end());
+		assert(std::unique(all.begin(), all.end()) == all.end(), "internExample: names should get distinct ids");
+		assert(dispatcher.internExample("3/7") == ids[3][7], "internExample: should return the same id for a name");
+		assert(!dispatcher.hasExampleHandlers("0/0") && dispatcher.countExampleHandlers("shared") == 1);
+	}, "EventThreadedDispatcher - on, trigger and remove from several threads");
+
+	runTest([]{
+		ExampleThreadedEventEmitterImpl test;
+		std::atomic<long> sum(0);
+		std::atomic<int> onceRuns(0);
+		for(int i = 0;i < 200;++i) {
+			test.onExample([&, i](int a, int b, std::string str) {
+				sum += a + i;
+			});
+		}
+		test.onceExample([&](int a, int b, std::string str) {
+			onceRuns++;
+		});
+		test.parallelTriggerExample(1, 0, "");
+		assert(sum == 200 + 199 * 200 / 2 && onceRuns == 1, "every handler should have run before parallelTrigger returns");
+		test.parallelTriggerExample(1, 0, "");
+		assert(onceRuns == 1, "once handler should run once");
+
+		std::atomic<bool> nested(false);
+		test.asyncOnceExample([&](int a, int b, std::string str) {
+			test.parallelTriggerExample(0, 0, "");
+			nested = true;
+		});
+		test.triggerExample(0, 0, "");
+		while(!nested) {
+			std::this_thread::yield();
+		}
+
+		test.onExample([&](int a, int b, std::string str) {
+			throw test_exception("handler");
+		});
+		bool thrown = false;
+		try {
+			test.parallelTriggerExample(0, 0, "");
+		}
+		catch(test_exception&) {
+			thrown = true;
+		}
+		assert(thrown, "parallelTrigger should rethrow a handler exception");
+	}, "EventThreadedEmitter - parallelTrigger");
+
+	runTest([]{
+		EE::ThreadPool pool(3);
+		struct Both : ExampleDeferredEventEmitterTpl<int>, ExampleDeferredEventEmitterTpl<std::string> {} both;
+		ExampleDeferredEventEmitterTpl<int>& ints = both;
+		ExampleDeferredEventEmitterTpl<std::string>& strings = both;
+		std::vector<int> intOrder, stringOrder;
+		ints.onExample([&](int i) {
+			intOrder.push_back(i);
+		});
+		strings.onExample([&](const std::string& str) {
+			stringOrder.push_back(std::stoi(str));
+		});
+		for(int i = 0;i < 1000;++i) {
+			ints.triggerExample(i);
+			strings.triggerExample(std::to_string(i));
+		}
+		both.runDeferredParallel(pool, 4);
+		assert(intOrder.size() == 1000 && stringOrder.size() == 1000, "runDeferredParallel: should run every event");
+		for(int i = 0;i < 1000;++i) {
+			assert(intOrder[i] == i && stringOrder[i] == i, "runDeferredParallel: should keep order per emitter");
+		}
+		assert(!both.runDeferred(), "runDeferredParallel: queue should be empty");
+
+		std::atomic<int> count(0);
+		ints.removeAllExampleHandlers();
+		ints.onExample([&](int i) {
+			count++;
+		});
+		for(int i = 0;i < 1000;++i) {
+			ints.triggerExample(i);
+		}
+		both.runDeferredParallel(pool, 0, EE::DeferredOrder::none);
+		assert(count == 1000, "runDeferredParallel: should run every unordered event");
+
+		// only a threaded emitter's handlers may run on several threads at once
+		ExampleThreadedEventEmitterTpl<int> threaded;
+		std::atomic<int> threadedCount(0);
+		threaded.onExample([&](int) {
+			threadedCount++;
+		});
+		for(int i = 0;i < 1000;++i) {
+			threaded.deferExample(i);
+		}
+		threaded.runDeferredParallel(pool, 4, EE::DeferredOrder::none);
+		assert(threadedCount == 1000, "runDeferredParallel: should run every unordered threaded event");
+	}, "EventDeferredEmitter - runDeferredParallel per emitter");
+
+	runTest([] {
+		EE::ThreadPool pool(2);
+		ExampleDeferredEventEmitterTpl<int> test;
+		std::atomic<int> ran(0);
+		test.onExample([&](int i) {
+			ran++;
+			if(i == 0) {
+				test.triggerExample(1);
+				test.runDeferred();
+			}
+			if(i == 3) {
+				test.clearDeferred();
+			}
+		});
+		test.triggerExample(0);
+		test.triggerExample(2);
+		bool thrown = false;
+		try {
+			test.runDeferredParallel(pool, 3);
+		}
+		catch(std::logic_error&) {
+			thrown = true;
+		}
+		assert(thrown, "runDeferredParallel: a handler running deferred events should throw");
+		assert(ran == 2, "runDeferredParallel: should run the rest of the batch");
+		test.runAllDeferred();
+		assert(ran == 3, "runDeferredParallel: events queued by the handlers should stay queued");
+
+		test.triggerExample(3);
+		test.triggerExample(4);
+		thrown = false;
+		try {
+			test.runDeferredParallel(pool, 3);
+		}
+		catch(std::logic_error&) {
+			thrown = true;
+		}
+		assert(thrown, "runDeferredParallel: a handler clearing deferred events should throw");
+		assert(ran == 5, "runDeferredParallel: should not drop the batch for a handler clearing it");
+	}, "EventDeferredEmitter - runDeferredParallel rejects nested drains");
+
+	runTest([]{
+		EE::ThreadPool pool(3);
+		struct Both : ExampleDeferredEventEmitterTpl<int>, ExampleDeferredEventEmitterTpl<std::string> {} both;
+		ExampleDeferredEventEmitterTpl<int>& ints = both;
+		ExampleDeferredEventEmitterTpl<std::string>& strings = both;
+		std::vector<int> intOrder, stringOrder;
+		std::atomic<int> intsRunning(0), stringsRunning(0);
+		std::atomic<bool> overlapped(false);
+		ints.onExample([&](int i) {
+			overlapped = overlapped || ++intsRunning > 1;
+			intOrder.push_back(i);
+			intsRunning--;
+		});
+		strings.onExample([&](const std::string& str) {
+			overlapped = overlapped || ++stringsRunning > 1;
+			stringOrder.push_back(std::stoi(str));
+			stringsRunning--;
+		});
+		for(EE::DeferredOrder order : {EE::DeferredOrder::perEmitter, EE::DeferredOrder::none}) {
+			intOrder.clear();
+			stringOrder.clear();
+			for(int i = 0;i < 1000;i += 4) {
+				ints.triggerExample(i);
+				strings.triggerExample(std::to_string(i));
+				ints.triggerExampleBatch(std::vector<std::tuple<int>>{std::make_tuple(i + 1), std::make_tuple(i + 2)});
+				strings.triggerExampleBatch(std::vector<std::tuple<std::string>>{std::make_tuple(std::to_string(i + 1)), std::make_tuple(std::to_string(i + 2))});
+				ints.triggerExampleByRef(i + 3);
+				strings.triggerExampleByRef(std::to_string(i + 3));
+			}
+			both.runDeferredParallel(pool, 4, order);
+			assert(intOrder.size() == 1000 && stringOrder.size() == 1000, "runDeferredParallel: should run batch and by-ref events");
+			for(int i = 0;i < 1000;++i) {
+				assert(intOrder[i] == i && stringOrder[i] == i, "runDeferredParallel: batch and by-ref events should keep order with the emitter's triggers");
+			}
+			assert(!overlapped, "runDeferredParallel: an emitter's handlers should not run on two threads at once");
+		}
+	}, "EventDeferredEmitter - runDeferredParallel with batch and by-ref events");
+
+	runTest([]{
+		EE::ThreadPool pool(3);
+		ExampleDeferredEventDispatcherImpl dispatcher;
+		std::vector<int> orders[8];
+		for(int key = 0;key < 8;++key) {
+			dispatcher.onExample("key" + std::to_string(key), [&orders, key](int a, int b, std::string str) {
+				if(a < 0) {
+					throw test_exception("handler");
+				}
+				orders[key].push_back(a);
+			});
+		}
+		for(int i = 0;i < 800;++i) {
+			dispatcher.triggerExample("key" + std::to_string(i % 8), i / 8, 0, "");
+		}
+		dispatcher.triggerExample("key3", -1, 0, "");
+		dispatcher.triggerExample("key3", 100, 0, "");
+		bool thrown = false;
+		try {
+			dispatcher.runDeferredParallel(pool, 4, EE::DeferredOrder::perKey);
+		}
+		catch(test_exception&) {
+			thrown = true;
+		}
+		assert(thrown, "runDeferredParallel: should rethrow a handler exception");
+		for(int key = 0;key < 8;++key) {
+			assert(orders[key].size() == (key == 3 ? 101 : 100), "runDeferredParallel: should run every event");
+			for(int i = 0;i < (int)orders[key].size();++i) {
+				assert(orders[key][i] == i, "runDeferredParallel: should keep order per key");
+			}
+		}
+		assert(!dispatcher.runDeferred(), "runDeferredParallel: queue should be empty");
+	}, "EventDeferredDispatcher - runDeferredParallel per key");
 	
 #endif
 	